@@ -27,37 +27,44 @@ const Action buffer_actions[] = {
 	/* Command      Shortcut       Function     Argument(s) */
 
 	/* Movement */
-	{  L"left",     L'h',          motion,      { .x = -1 } },
-	{  L"down",     L'j',          motion,      { .y = +1 } },
-	{  L"up",       L'k',          motion,      { .y = -1 } },
-	{  L"right",    L'l',          motion,      { .x = +1 } },
+	{  "left",      L'h',          motion,      { .x = -1 } },
+	{  "down",      L'j',          motion,      { .y = +1 } },
+	{  "up",        L'k',          motion,      { .y = -1 } },
+	{  "right",     L'l',          motion,      { .x = +1 } },
 	{  NULL,        CTRL('d'),     motion,      { .y = +20 } },
 	{  NULL,        CTRL('u'),     motion,      { .y = -20 } },
-	{  L"left",     KEY_LEFT,      motion,      { .x = -1 } },
-	{  L"down",     KEY_DOWN,      motion,      { .y = +1 } },
-	{  L"up",       KEY_UP,        motion,      { .y = -1 } },
-	{  L"right",    KEY_RIGHT,     motion,      { .x = +1 } },
+	{  "left",      KEY_LEFT,      motion,      { .x = -1 } },
+	{  "down",      KEY_DOWN,      motion,      { .y = +1 } },
+	{  "up",        KEY_UP,        motion,      { .y = -1 } },
+	{  "right",     KEY_RIGHT,     motion,      { .x = +1 } },
 	{  NULL,        KEY_BACKSPACE, motion,      { .x = -1 } },
 	{  NULL,        L'\n',         motion,      { .y = +1 } },
 	{  NULL,        L' ',          motion,      { .x = +1 } },
-	{  L"home",     KEY_HOME,      motion,      { .y = -(1<<30) } },
-	{  L"end",      KEY_END,       motion,      { .y = +(1<<30) } },
-	{  L"pgup",     KEY_PPAGE,     pgup,        {{ 0 }} },
-	{  L"pgdown",   KEY_NPAGE,     pgdown,      {{ 0 }} },
+	{  "home",      KEY_HOME,      motion,      { .y = -(1<<30) } },
+	{  "end",       KEY_END,       motion,      { .y = +(1<<30) } },
+	{  "pgup",      KEY_PPAGE,     pgup,        {{ 0 }} },
+	{  "pgdown",    KEY_NPAGE,     pgdown,      {{ 0 }} },
 	{  NULL,        L'0',          jump,        { .m = MARKER_START } },
 	{  NULL,        L'&',          jump,        { .m = MARKER_MIDDLE } },
 	{  NULL,        L'$',          jump,        { .m = MARKER_END } },
-	{  L"coc",      L'C',          coc,         {{ 0 }} },
+	{  "coc",       L'C',          coc,         {{ 0 }} },
+	{  "wrap",       0,            wrap,        {{ 0 }} },
+	{  "goto",      L'G',          gotoline,    {{ 0 }} },
+	{  "goto-byte",  0,            gotooffset,  {{ 0 }} },
+	{  NULL,        L'%',          gotopercent, {{ 0 }} },
 
 	/* Buffer management */
-	{  L"bn",       CTRL('n'),     bufsel,      { .i = +1 } },
-	{  L"bp",       CTRL('p'),     bufsel,      { .i = -1 } },
-	{  L"bd",       CTRL('x'),     bufdel,      { .i = 0 } },
-	{  L"cls",      0,             cls,         {{ 0 }} },
-	{  L"edit",     L'e',          readfile,    {{ 0 }} },
-	{  L"read",     L'r',          readstr,     {{ 0 }} },
-	{  L"find",     L'f',          find,        {{ 0 }} },
-	{  L"lsb",      0,             listbuffers, {{ 0 }} },
+	{  "bn",        CTRL('n'),     bufsel,      { .i = +1 } },
+	{  "bp",        CTRL('p'),     bufsel,      { .i = -1 } },
+	{  "bd",        CTRL('x'),     bufdel,      { .i = 0 } },
+	{  "cancel",    0,             cancel,      {{ 0 }} },
+	{  NULL,        ESC,           cancel,      {{ 0 }} },
+	{  "cls",       0,             cls,         {{ 0 }} },
+	{  "edit",      L'e',          readfile,    {{ 0 }} },
+	{  "read",      L'r',          readstr,     {{ 0 }} },
+	{  "find",      L'f',          find,        {{ 0 }} },
+	{  "lsb",       0,             listbuffers, {{ 0 }} },
+	{  "mem",       0,             memstats,    {{ 0 }} },
 
 	/* Mode switching */
 	{  NULL,        ESC,           setmode,     { .i = MODE_NORMAL } },
@@ -67,36 +74,88 @@ const Action buffer_actions[] = {
 	{  NULL,        KEY_IC,        setmode,     { .i = MODE_INSERT } },
 
 	/* File I/O */
-	{  L"write",    CTRL('w'),     save,        { .v = NULL } },
-	{  L"manual",   L'?',          readfile,    { .v = (void*)manual_path } },
-	{  L"help",     L'?',          readfile,    { .v = (void*)manual_path } },
+	{  "write",     CTRL('w'),     save,        { .v = NULL } },
+	{  "manual",    L'?',          readfile,    { .v = (void*)manual_path } },
+	{  "help",      L'?',          readfile,    { .v = (void*)manual_path } },
 
 	/* Buffer modification */
-	{  L"bs",       0,             insert,      { .i = KEY_BACKSPACE } },
-	{  L"del",      'x',           insert,      { .i = KEY_DC } },
-	{  L"delln",    'Z',           freeln,      {{ 0 }} },
-	{  L"del",      KEY_DC,        insert,      { .i = KEY_DC } },
-	{  L"append",   L'A',          append,      {{ 0 }} },
-	{  L"newln",    L'o',          newln,       {{ 0 }} },
+	{  "bs",        0,             insert,      { .i = KEY_BACKSPACE } },
+	{  "del",       'x',           insert,      { .i = KEY_DC } },
+	{  "delln",     'Z',           freeln,      {{ 0 }} },
+	{  "del",       KEY_DC,        insert,      { .i = KEY_DC } },
+	{  "append",    L'A',          append,      {{ 0 }} },
+	{  "newln",     L'o',          newln,       {{ 0 }} },
+	{  "undo",      L'u',          undo,        {{ 0 }} },
+	{  "redo",      CTRL('r'),     redo,        {{ 0 }} },
+	{  "recover",   0,             recover,     {{ 0 }} },
 
 	/* Misc */
-	{  L"print",    L'p',          print,       {{ 0 }} },
-	{  L"about",    0,             print,       { .v = (void*)VERSION_STRING } },
-	{  L"quit",     L'q',          quit,        {{ 0 }} },
-	{  L"exit",     0,             quit,        {{ 0 }} },
+	{  "print",     L'p',          print,       {{ 0 }} },
+	{  "about",     0,             print,       { .v = (void*)VERSION_STRING } },
+	{  "quit",      L'q',          quit,        {{ 0 }} },
+	{  "exit",      0,             quit,        {{ 0 }} },
 	{  NULL,        KEY_MOUSE,     handlemouse, {{ 0 }} },
-	{  L"resize",   KEY_RESIZE,    resize,      {{ 0 }} },
+	{  "resize",    KEY_RESIZE,    resize,      {{ 0 }} },
 };
 
 static bool use_colors = true;
 static bool line_numbers = true;
+static bool relative_numbers = false;
 static bool auto_indent = true;
 
+/* Wrap lines that don't fit on the screen. Otherwise the view
+ * scrolls sideways, see the wrap command. */
+static bool line_wrap = true;
+
+/* Have the terminal mark pasted text, so that it goes in as it is:
+ * without auto_indent, in one go, and undone at once */
+static const bool bracketed_paste = true;
+
 /* Always have the cursor at the center of the screen */
 static bool always_centered = false;
 
-/* Maximum line size in bytes until reallocation */
-static const unsigned default_linebuf_size = 128*4;
+/* Size of the blocks holding inserted text, in bytes.
+ * Blocks start small and double in size up to the maximum. */
+static const size_t default_addblock_size = 256;
+static const size_t max_addblock_size = 1 << 20;
+
+/* Lines and pieces are carved out of slabs of this many bytes,
+ * which grow the same way */
+static const size_t default_slab_size = 4096;
+static const size_t max_slab_size = 1 << 22;
+
+/* Text is kept in pieces of at most this many bytes, which know
+ * how many columns they take up. Long lines are laid out and edited
+ * without going over all of them. */
+static const size_t piece_size = 512;
+
+/* Lines are only loaded when they are needed, until then they are
+ * kept in blocks of lazy_block_lines. Files at least lazy_load_size
+ * big are mapped instead of read. */
+static const size_t lazy_load_size = 1 << 26;
+static const size_t lazy_block_lines = 1024;
+
+/* Number of threads looking for the lines of a file, 0 for
+ * one per CPU. Each of them gets at least load_chunk_size bytes. */
+static const unsigned load_threads = 0;
+static const size_t load_chunk_size = 1 << 24;
+
+/* While files are loaded, the screen is updated this often (in ms) */
+static const int load_update_ms = 20;
+
+/* When keys come in faster than they can be shown, e.g. while one
+ * is held down, the screen is updated at most this often (in ms) */
+static const int frame_ms = 16;
+
+/* Log edits to .name.mett next to the file, so that :recover can
+ * bring them back after a crash. The log is written out at most
+ * every journal_flush_ms. */
+static const bool crash_journal = true;
+static const int journal_flush_ms = 500;
+
+/* Bytes of undo history per buffer. Edits only refer to their
+ * text, so this is mostly a limit on how many there are. */
+static const size_t undo_budget = 1 << 22;
 
 static const unsigned tab_width = 4;
 
@@ -104,7 +163,15 @@ static const unsigned tab_width = 4;
 static const wchar_t tab_beginning = L'→';
 static const wchar_t tab_character = L' ';
 
-/* Copy buffer to backup_path before overwriting file */
+/* Whether to wait for written files to reach the disk: SYNC_NONE,
+ * SYNC_FILE before the new file replaces the old one, or SYNC_DIR
+ * for the rename as well. Anything but SYNC_NONE also syncs the
+ * crash journals whenever they are written out. */
+static const Sync sync_on_write = SYNC_FILE;
+
+/* Keep the old file at backup_path when writing over it. The old
+ * file itself is linked there when a new one takes its place on the
+ * same filesystem, otherwise it is a reflink if possible, or a copy. */
 static const bool backup_on_write = true;
 static const char *backup_path = "/tmp/.mett-backup";
 
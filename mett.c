@@ -1,24 +1,50 @@
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 #define _XOPEN_SOURCE_EXTENDED
+#ifdef __linux__
+#define _GNU_SOURCE /* For copy_file_range */
+#endif
+#include <assert.h>
 #include <ctype.h>
 #include <curses.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#undef CTRL /* From sys/ttydefaults.h, config.h has its own */
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MSCAN_X86
+#include <immintrin.h>
+#endif
+
 #define SWAP(X, Y, T) { T SWAP = X; X = Y; Y = SWAP; }
+#define LENGTH(X) (sizeof(X) / sizeof(*(X)))
 #define BINDABLE(fn) static void fn()
+#define KEY_PASTE (KEY_MAX + 1) /* Start of a bracketed paste */
 
 typedef enum {
 	MODE_NORMAL,
@@ -33,6 +59,19 @@ typedef enum {
 	MARKER_END
 } Marker;
 
+typedef enum {
+	SYNC_NONE, /* Leave it to the system */
+	SYNC_FILE, /* Flush the file before it replaces the old one */
+	SYNC_DIR   /* Also flush the directory holding it */
+} Sync;
+
+typedef enum {
+	SWAP_OFF,     /* The next edit starts a new journal */
+	SWAP_PENDING, /* A journal left behind waits for :recover */
+	SWAP_HELD,    /* Edited before recovering, so nothing is logged */
+	SWAP_FAILED   /* The journal can't be written */
+} Swap;
+
 typedef struct {
 	int x, y;
 } Coord;
@@ -43,24 +82,172 @@ typedef struct {
 	Coord v1; /* Visual selection end */
 } Cursor;
 
+typedef struct node {
+	struct node *up, *l, *r;
+	unsigned prio;
+	size_t len[2]; /* Weights of this node */
+	size_t sum[2]; /* Weights of the whole subtree */
+} Node;
+
+typedef struct {
+	Node n; /* Must come first */
+	const char *data;
+	bool plain; /* Every character is one byte and one column */
+} Piece;
+
+typedef struct block {
+	struct block *next;
+	size_t len, cap;
+	char data[];
+} Block;
+
+typedef struct slab {
+	struct slab *next;
+	size_t cap, used; /* Number of objects */
+	char data[];
+} Slab;
+
+typedef struct {
+	size_t size;    /* Size of one object */
+	Slab *slabs;    /* Newest first, only the first one has room */
+	void *free;     /* Released objects, linked through their first word */
+	size_t nfree;
+	size_t nslabs, cap;
+} Pool;
+
+typedef struct {
+	const char *data;
+	size_t len;
+} Span;
+
+typedef struct {
+	size_t y, x;   /* Where the text starts */
+	size_t ey, ex; /* Where it ends */
+	size_t len;    /* Bytes, newlines included */
+	bool del;      /* The text was deleted, not inserted */
+	Span *spans;   /* The text, where it is kept */
+	size_t nspans, cap;
+} Edit;
+
+typedef struct {
+	Edit *edits;   /* Oldest first */
+	size_t n, cap;
+	size_t done;   /* Edits before this one are applied */
+	size_t size;   /* Bytes used, see undo_budget */
+	bool sealed;   /* The next edit can't join the last one */
+} Journal;
+
+/* A loaded line takes a Line and a Piece per piece_size bytes of it,
+ * about 200 bytes for a short one. Lines not loaded yet share a Line
+ * with the rest of their block. */
 typedef struct line {
+	Node n; /* Line index entry: one line, length + 1 bytes */
 	struct line *next, *prev;
-	size_t length;
-	wchar_t data[];
+	size_t length; /* Number of bytes */
+	Node *pieces;  /* Text of the line, in order */
+	const char *lazy; /* Set for blocks of lines not loaded yet */
+	size_t gen;    /* Changes with the text, never used twice */
 } Line;
 
 typedef struct buffer {
 	struct buffer *next, *prev;
 	char *path;
 	Line *lines, *curline;
+	Node *index;   /* All lines, for lookups by number or offset */
+	char *orig;    /* Contents of the file, never modified */
+	size_t origlen; /* Size of orig */
+	size_t maplen; /* Size of orig if it is mapped */
+	dev_t mapdev;  /* The file orig is mapped from */
+	ino_t mapino;
+	size_t invalid; /* Bytes that weren't UTF-8 when loading */
+	struct load *load; /* Set while the file is being loaded */
+	bool partial;  /* Loading was cancelled or failed */
+	Block *add;    /* Append-only storage for inserted text */
+	Pool linepool, piecepool;
+	Journal undo;
+	struct stat st; /* The file as it was read or written */
+	FILE *swap;    /* Crash journal, see mswapopen */
+	Edit swaprun;  /* Inserts not logged yet */
+	bool swapdirty; /* Not flushed yet */
+	Swap swapstate; /* While no journal is open */
 	Cursor cursor;
+	size_t dirty[2]; /* Lines from dirty[0] up to dirty[1] need painting */
 	int starty;
+	int startx;    /* First column shown when lines don't wrap */
 	int offsetx;
 	int numlines;
 } Buffer;
 
 typedef struct {
-	wchar_t *cmd;
+	Line *ln;      /* NULL for rows past the last line */
+	size_t y;      /* Index of ln */
+	size_t k;      /* Row of ln it is, 0 for the first */
+	size_t from, to; /* Bytes of ln on the row */
+	size_t col;    /* Column of from in ln */
+	size_t left;   /* Column of ln at the left edge, from may start
+	                * before it when lines don't wrap */
+} Row;
+
+typedef struct {
+	Buffer *buf;   /* What was painted last */
+	int offsetx, cols, startx;
+	Coord v0, v1;
+	Row *rows;     /* What is on every row */
+	size_t nrows, cap;
+} View;
+
+typedef struct {
+	struct load *load;
+	int fd;
+	size_t from, to; /* Part of the file, starting at a line */
+	size_t pos;      /* How far it was scanned */
+	size_t per;      /* Lines per cut */
+	size_t skip;     /* Newlines that are cuts of their own */
+	size_t *cuts;    /* Ends of every per lines */
+	size_t ncuts, cap;
+	size_t lines;    /* Newlines after the last cut */
+	size_t last;     /* End of the last line */
+	size_t invalid;
+	bool done, err;
+	pthread_t tid;
+	bool threaded;
+} Chunk;
+
+typedef struct load {
+	pthread_mutex_t lock; /* For everything the threads change */
+	FILE *fp;
+	char *orig;
+	size_t len;
+	Chunk *chunks;
+	size_t nchunks;
+	size_t next, used; /* First part and cut not added yet */
+	size_t start, cnt; /* Start and number of lines not added yet */
+	size_t end;        /* End of the last line found */
+	bool started;      /* The first line is there */
+	bool mapped;       /* orig is only read where lines get loaded */
+	bool cancel;
+} Load;
+
+typedef struct {
+	Node *t;    /* Current piece */
+	size_t off; /* Offset into the piece */
+	size_t pos; /* Offset into the line */
+} Iter;
+
+typedef struct {
+	const Line *ln;
+	size_t gen;    /* ln->gen it was made for */
+	size_t width;  /* Columns taken up by the whole line */
+	int cols;      /* Width of the rows it was made for, 0 if
+	                * lines don't wrap */
+	struct { size_t pos, col; } *rows; /* Where every row starts */
+	size_t nrows, rcap;
+	struct { int x, w; size_t from, to, col; } clip; /* What was
+	                * between the edges the last time */
+} Layout;
+
+typedef struct {
+	char *cmd;
 	int key;
 	void (*fn)();
 	union Arg {
@@ -76,30 +263,151 @@ static int32_t max(int32_t, int32_t);
 
 static void msighandler(int);
 
+static Node* mtfix(Node*);
+static Node* mtroot(Node*);
+static Node* mtmerge(Node*, Node*);
+static void  mtsplit(Node*, int, size_t, Node**, Node**);
+static Node* mtfind(Node*, int, size_t, size_t*);
+static size_t mtpos(Node*, int);
+static Node* mtfirst(Node*);
+static Node* mtnext(Node*);
+static void  mtgrow(Node*, int, long);
+static void  mtpush(Node**, Node*, Node*);
+static void  mtsum(Node*);
+static void  mtfree(Pool*, Node*);
+static unsigned mtprio();
+
+static int  mutf8dec(const char*, size_t, wchar_t*);
+static int  mutf8enc(wchar_t, char*);
+static size_t mutf8start(const char*, size_t, size_t);
+static void mitinit(Iter*, Line*, size_t);
+static int  mitnext(Iter*, wchar_t*);
+static size_t mlnnext(Line*, size_t);
+static size_t mlnprev(Line*, size_t);
+static size_t mlnsnap(Line*, size_t);
+static int  mcharwidth(wchar_t);
+static int  mwidth(wchar_t);
+
+static uint64_t mscan64(const char*, uint64_t*);
+#ifdef MSCAN_X86
+static uint64_t mscan64sse2(const char*, uint64_t*);
+static uint64_t mscan64avx2(const char*, uint64_t*);
+#endif
+static void mscaninit();
+static size_t mscan(const char*, size_t, bool, size_t*, size_t*, size_t*);
+
+static void* mpoolget(Pool*);
+static void mpoolput(Pool*, void*);
+static void mpoolclear(Pool*);
+
+static const char* maddtext(Buffer*, const char*, size_t);
+static Piece* mnewpiece(Buffer*, const char*, size_t);
+static Node* mnewtext(Buffer*, const char*, size_t);
+static size_t mspancols(const char*, size_t, bool*);
+static void mmeasure(Node*);
+static void mtmatch(Node*, Node*);
+static void mlncut(Buffer*, Line*, size_t);
+static const char* mlninsert(Buffer*, Line*, size_t, const char*, size_t);
+static void mlnerase(Buffer*, Line*, size_t, size_t);
+static Node* mlnsplit(Buffer*, Line*, size_t);
+static void mlnjoin(Line*, Node*);
+static size_t mlncopy(Line*, char*, size_t);
+static void mlngrow(Line*, long);
+static Line* mnewln(Buffer*);
+static Line* mlnafter(Buffer*, Line*);
+static void mlnlink(Buffer*, Line*, Line*);
+static Line* mlnat(Buffer*, size_t);
+static Line* mlnload(Buffer*, Line*, size_t);
+static Line* mnextln(Buffer*, Line*);
+static Line* mprevln(Buffer*, Line*);
+static size_t mlnidx(Line*);
+static char* mlnstr(Line*);
+static const char* mlntext(Line*);
+static int mreserve(void**, size_t*, size_t);
+
 static Buffer* mnewbuf();
 static void mfreebuf(Buffer*);
 static void mclearbuf(Buffer*);
+static void mfreetext(Buffer*);
 static int  mreadfile(Buffer*, const char*);
+static int  mreadall(Buffer*, FILE*);
+static int  mwritebuf(Buffer*, int);
+static int  mgather(int, struct iovec*, int*, const char*, size_t);
+static int  mflushv(int, struct iovec*, int);
+static int  msyncdir(const char*);
+static int  mdetach(Buffer*);
+static int  mbackup(const char*, const char*, bool);
+static int  mreadasync(Buffer*, FILE*, size_t);
+static size_t mlinestart(int, size_t, size_t);
+static void* mscanchunk(void*);
+static void mloadstep(Buffer*);
+static Line* mloadcut(Buffer*, Line*, Node**, Node**, size_t, size_t);
+static void mloadend(Buffer*, bool);
+static void mloadstop(Load*);
+static void mloadfree(Buffer*);
+static int  mloadall();
+static int  mloadprogress(Buffer*);
+static int  mfindlazy(Line*, regex_t*, regmatch_t*, size_t*);
+static Line* mnewblock(Buffer*, Line*, Node**, Node**, const char*, size_t, size_t);
 static void mreadstr(Buffer*, const char*);
 
+#ifdef DEBUG
 static int  mnumlines(Buffer*);
-static int  mnumvislines(Line*);
-static int  mnumcols(Line*, int );
+#endif
+static void mchecklines(Buffer*);
+static int  mnumvislines(Buffer*, Line*);
+static Layout* mlayout(Buffer*, Line*);
+static size_t mlayoutrow(Layout*, size_t);
+static int  mnumcols(Buffer*, Line*, int );
+static size_t mcolbyte(Buffer*, Line*, size_t, size_t*);
+static int  mtextcols(Buffer*);
+static int  mcursorcol(Buffer*);
+static int  mlayoutln(Buffer*, Row*, int, int, Line*, size_t);
+static void mlayoutrows(Buffer*, Row*, int);
+static size_t mrowbyte(const Row*, int);
 static void mupdatecursor();
 static void mcmdkey(wint_t);
 static void minsert(Buffer*, wint_t);
-static int  mindent(Line*, int);
-static void mfreeln(Line*);
-static void msetln(Line*, const wchar_t*);
+static void minserttext(Buffer*, const char*, size_t);
+static char* mreadpaste(size_t*);
+static int  mindent(Buffer*, Line*, int);
+static void mfreeln(Buffer*, Line*);
+static void msetln(Buffer*, Line*, const char*);
+static void mrecord(Buffer*, bool, Line*, size_t, const char*, size_t);
+static int  mspan(Edit*, const char*, size_t);
+static void mtextend(size_t*, size_t*, const Edit*);
+static void mjournal(Buffer*, Edit*);
+static void mjournalfree(Journal*);
+static void mundo(Buffer*, bool);
+static void mtextins(Buffer*, const Edit*);
+static void mtextdel(Buffer*, size_t, size_t, size_t);
+static char* mswappath(const char*);
+static int  mswapopen(Buffer*, const char*);
+static bool mswapmatch(Buffer*, FILE*);
+static void mswaplog(Buffer*, bool, const Edit*);
+static void mswapput(Buffer*);
+static void mswapclose(Buffer*, bool);
+static int  mswapsync();
+static int  mswapreplay(Buffer*);
+static long mclock();
+static bool mtypeahead();
 static void mmove(Buffer*, int, int);
+static void mfollow(Buffer*);
 static void mjump(Buffer*, Marker);
+static void mgoto(Buffer*, Line*, int);
+static void mgotopos(Buffer*, size_t, size_t);
+static void mrowgoto(Buffer*, const Row*, size_t, int);
+static Row* mscreen(Buffer*, int*);
+static void mpage(Buffer*, int);
 static void mselect(Buffer*, int, int, int, int);
-static void mrepeat(const Action*, int);
-static void mruncmd(wchar_t*);
+static void mrepeat(const Action*, size_t);
+static void mruncmd(char*);
 
 static void mpaintstat();
-static void mpaintln(Buffer*, Line*, WINDOW*, int, int, bool);
+static void mpaintln(Buffer*, WINDOW*, const Row*, int, int, int, bool);
+static void mputrun(WINDOW*, int, int, const wchar_t*, int*, bool);
 static void mpaintbuf(Buffer*, WINDOW*, bool);
+static void mdirty(Buffer*, size_t, size_t);
 static void mpaintcmd();
 
 BINDABLE (resize);
@@ -113,33 +421,49 @@ BINDABLE (readstr);
 BINDABLE (print);
 BINDABLE (find);
 BINDABLE (listbuffers);
+BINDABLE (memstats);
 BINDABLE (motion);
 BINDABLE (jump);
 BINDABLE (coc);
+BINDABLE (gotoline);
+BINDABLE (gotooffset);
+BINDABLE (gotopercent);
 BINDABLE (pgup);
 BINDABLE (pgdown);
 BINDABLE (cls);
+BINDABLE (wrap);
 BINDABLE (bufsel);
 BINDABLE (bufdel);
+BINDABLE (cancel);
 BINDABLE (insert);
 BINDABLE (freeln);
 BINDABLE (append);
 BINDABLE (newln);
+BINDABLE (undo);
+BINDABLE (redo);
+BINDABLE (recover);
 
 /* Global variables */
 static Mode mode = MODE_NORMAL;
 static WINDOW *bufwin, *statuswin, *cmdwin;
 static Buffer *buflist, *curbuf, *cmdbuf;
-static int repcnt = 0;
+static size_t lngen;
+static View bufview, cmdview;
+static uint64_t (*mscanner)(const char*, uint64_t*) = mscan64;
+static size_t repcnt = 0;
 
 /* We make all the declarations available to the user */
 #include "config.h"
+#include "width.h"
 
 int main(int argc, char **argv) {
-	int i;
+	int i, loading, due;
+	long painted = 0;
+	bool stale = false;
 	wint_t key;
 
 	setlocale(LC_ALL, "");
+	mscaninit();
 
 	/* Init buffers */
 	cmdbuf = mnewbuf();
@@ -161,6 +485,7 @@ int main(int argc, char **argv) {
 	noecho();
 	keypad(stdscr, TRUE);
 	notimeout(stdscr, FALSE);
+	if (bracketed_paste) define_key("\033[200~", KEY_PASTE);
 	set_escdelay(1);
 	use_default_colors();
 	mousemask(BUTTON1_CLICKED | REPORT_MOUSE_POSITION, NULL);
@@ -172,11 +497,27 @@ int main(int argc, char **argv) {
 	}
 
 	resize();
+	loading = mloadall();
 	repaint();
+	/* Curses has no say in this, it goes after its own setup */
+	if (bracketed_paste) fputs("\033[?2004h", stderr);
 
 	for (;;) {
-		get_wch(&key);
-		if (key != (wint_t)ERR) {
+		/* Files being loaded show up bit by bit, and edits are
+		 * journaled in batches */
+		due = mswapsync();
+		if (loading && (due < 0 || due > load_update_ms)) due = load_update_ms;
+		timeout(due);
+		if (get_wch(&key) == ERR) key = ERR;
+		if (key == KEY_PASTE) {
+			size_t n;
+			char *text = mreadpaste(&n), *nl;
+			/* A command ends at its first line */
+			if (text && mode == MODE_COMMAND && (nl = (char*)memchr(text, '\n', n)))
+				n = nl - text;
+			if (text) minserttext(mode == MODE_COMMAND ? cmdbuf : curbuf, text, n);
+			free(text);
+		} else if (key != (wint_t)ERR) {
 			switch (mode) {
 			case MODE_NORMAL:
 				/* Special keys will cancel action sequences */
@@ -200,7 +541,16 @@ int main(int argc, char **argv) {
 				else minsert(cmdbuf, key);
 				break;
 			}
+		}
+		loading = mloadall();
+		if (key != (wint_t)ERR || loading) stale = true;
+
+		/* Keys that came in meanwhile go first, but the screen is
+		 * still updated every frame_ms */
+		if (stale && (!mtypeahead() || mclock() - painted >= frame_ms)) {
 			repaint();
+			painted = mclock();
+			stale = false;
 		}
 	}
 
@@ -216,25 +566,796 @@ int32_t max(int32_t a, int32_t b) {
 }
 
 void msighandler(int signum) {
+	Buffer *b;
 	switch (signum) {
 	case SIGHUP:
 	case SIGKILL:
 	case SIGINT:
 	case SIGTERM:
+		/* Leave the journals behind for :recover */
+		for (b = buflist; b; b = b->next) mswapclose(b, true);
 		quit();
 		break;
 	}
 }
 
+/* Lines and the pieces of their text are kept in treaps, ordered by
+ * position. Every node has two weights (for lines the line count and
+ * the number of bytes, newlines included, for pieces the length in
+ * bytes and the number of columns) and only knows their sum over its
+ * subtree, so operations find their way from the root using
+ * relative positions. */
+
+Node* mtfix(Node *t) {
+	/* Recompute the subtree weights after the children changed */
+	int k;
+	for (k = 0; k < 2; ++k) {
+		t->sum[k] = t->len[k];
+		if (t->l) t->sum[k] += t->l->sum[k];
+		if (t->r) t->sum[k] += t->r->sum[k];
+	}
+	if (t->l) t->l->up = t;
+	if (t->r) t->r->up = t;
+	return t;
+}
+
+Node* mtroot(Node *t) {
+	if (t) t->up = NULL;
+	return t;
+}
+
+Node* mtmerge(Node *a, Node *b) {
+	/* Concatenate two trees, every node of a comes before b */
+	if (!a || !b) return a ? a : b;
+	if (a->prio > b->prio) {
+		a->r = mtmerge(a->r, b);
+		return mtfix(a);
+	}
+	b->l = mtmerge(a, b->l);
+	return mtfix(b);
+}
+
+void mtsplit(Node *t, int k, size_t pos, Node **a, Node **b) {
+	/* Nodes ending at or before pos go to a, the rest to b */
+	size_t ls;
+	if (!t) {
+		*a = *b = NULL;
+		return;
+	}
+	ls = t->l ? t->l->sum[k] : 0;
+	if (ls + t->len[k] <= pos) {
+		mtsplit(t->r, k, pos - ls - t->len[k], &t->r, b);
+		*a = mtfix(t);
+	} else {
+		mtsplit(t->l, k, pos, a, &t->l);
+		*b = mtfix(t);
+	}
+}
+
+Node* mtfind(Node *t, int k, size_t pos, size_t *off) {
+	/* Find the node covering pos */
+	while (t) {
+		size_t ls = t->l ? t->l->sum[k] : 0;
+		if (pos < ls) {
+			t = t->l;
+		} else if (pos < ls + t->len[k]) {
+			if (off) *off = pos - ls;
+			return t;
+		} else {
+			pos -= ls + t->len[k];
+			t = t->r;
+		}
+	}
+	return NULL;
+}
+
+size_t mtpos(Node *t, int k) {
+	/* Position of the start of a node */
+	size_t pos = t->l ? t->l->sum[k] : 0;
+	for (; t->up; t = t->up) {
+		if (t->up->r == t)
+			pos += t->up->len[k] + (t->up->l ? t->up->l->sum[k] : 0);
+	}
+	return pos;
+}
+
+Node* mtfirst(Node *t) {
+	if (t) while (t->l) t = t->l;
+	return t;
+}
+
+Node* mtnext(Node *t) {
+	if (t->r) return mtfirst(t->r);
+	while (t->up && t->up->r == t) t = t->up;
+	return t->up;
+}
+
+void mtgrow(Node *t, int k, long n) {
+	/* Change the weight of a node in place */
+	t->len[k] += n;
+	for (; t; t = t->up) t->sum[k] += n;
+}
+
+void mtpush(Node **root, Node *last, Node *t) {
+	/* Append t after last, the rightmost node. The weights are
+	 * left alone, call mtsum once everything has been added. */
+	Node *up = last;
+	while (up && up->prio < t->prio) up = up->up;
+	if (up) {
+		t->l = up->r;
+		up->r = t;
+	} else {
+		t->l = *root;
+		*root = t;
+	}
+	if (t->l) t->l->up = t;
+	t->up = up;
+}
+
+void mtsum(Node *t) {
+	if (t) {
+		mtsum(t->l);
+		mtsum(t->r);
+		mtfix(t);
+	}
+}
+
+void mtfree(Pool *pool, Node *t) {
+	if (t) {
+		mtfree(pool, t->l);
+		mtfree(pool, t->r);
+		mpoolput(pool, t);
+	}
+}
+
+unsigned mtprio() {
+	/* xorshift, the priorities only have to look random */
+	static unsigned seed = 2463534242u;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int mutf8dec(const char *s, size_t n, wchar_t *c) {
+	/* Decode one character of at most n bytes and return its length.
+	 * Bytes that don't form valid UTF-8 are taken one at a time. */
+	const unsigned char *u = (const unsigned char*)s;
+	int i, len;
+	wchar_t wc;
+
+	if (u[0] < 0x80) {
+		*c = u[0];
+		return 1;
+	}
+	if ((u[0] & 0xE0) == 0xC0) {
+		len = 2;
+		wc = u[0] & 0x1F;
+	} else if ((u[0] & 0xF0) == 0xE0) {
+		len = 3;
+		wc = u[0] & 0x0F;
+	} else if ((u[0] & 0xF8) == 0xF0) {
+		len = 4;
+		wc = u[0] & 0x07;
+	} else {
+		len = 0;
+		wc = 0;
+	}
+	for (i = 1; i < len && (size_t)i < n && (u[i] & 0xC0) == 0x80; ++i)
+		wc = (wc << 6) | (u[i] & 0x3F);
+
+	/* Reject truncated and overlong forms, surrogates and
+	 * everything past U+10FFFF */
+	if (!len || i < len ||
+			wc < (len == 2 ? 0x80 : len == 3 ? 0x800 : 0x10000) ||
+			(wc >= 0xD800 && wc <= 0xDFFF) || wc > 0x10FFFF) {
+		*c = 0xFFFD;
+		return 1;
+	}
+	*c = wc;
+	return len;
+}
+
+int mutf8enc(wchar_t c, char *s) {
+	/* Encode c into s (4 bytes at most), return the length */
+	if (c < 0x80) {
+		s[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		s[0] = 0xC0 | (c >> 6);
+		s[1] = 0x80 | (c & 0x3F);
+		return 2;
+	} else if (c < 0x10000) {
+		s[0] = 0xE0 | (c >> 12);
+		s[1] = 0x80 | ((c >> 6) & 0x3F);
+		s[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	s[0] = 0xF0 | ((c >> 18) & 0x07);
+	s[1] = 0x80 | ((c >> 12) & 0x3F);
+	s[2] = 0x80 | ((c >> 6) & 0x3F);
+	s[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+size_t mutf8start(const char *s, size_t n, size_t off) {
+	/* Start of the character byte off of s is part of */
+	const unsigned char *u = (const unsigned char*)s;
+	size_t start;
+	wchar_t c;
+
+	for (start = off; start > 0 && off - start < 3 && (u[start] & 0xC0) == 0x80; --start);
+	if (start < off && mutf8dec(s + start, n - start, &c) > (int)(off - start))
+		return start;
+	return off;
+}
+
+void mitinit(Iter *it, Line *ln, size_t pos) {
+	/* Start iterating over the characters of ln at byte pos */
+	it->pos = pos;
+	if (!(it->t = mtfind(ln->pieces, 0, pos, &it->off))) it->off = 0;
+}
+
+int mitnext(Iter *it, wchar_t *c) {
+	/* Decode the next character, return its length or 0 at the end.
+	 * Pieces always start on character boundaries. */
+	int len;
+	if (!it->t) return 0;
+	len = mutf8dec(((Piece*)it->t)->data + it->off, it->t->len[0] - it->off, c);
+	it->pos += len;
+	if ((it->off += len) >= it->t->len[0]) {
+		it->t = mtnext(it->t);
+		it->off = 0;
+	}
+	return len;
+}
+
+size_t mlnnext(Line *ln, size_t x) {
+	/* Start of the character after the one at x */
+	wchar_t c;
+	Iter it;
+	mitinit(&it, ln, x);
+	return x + mitnext(&it, &c);
+}
+
+size_t mlnprev(Line *ln, size_t x) {
+	/* Start of the character ending at x */
+	const unsigned char *s;
+	size_t off, start;
+	wchar_t c;
+	Node *t;
+
+	if (!x || !(t = mtfind(ln->pieces, 0, x - 1, &off))) return 0;
+	s = (const unsigned char*)((Piece*)t)->data;
+	for (start = off; start > 0 && off - start < 3 && (s[start] & 0xC0) == 0x80; --start);
+	if (mutf8dec((const char*)s + start, t->len[0] - start, &c) != (int)(off - start + 1))
+		start = off;
+	return x - 1 - (off - start);
+}
+
+size_t mlnsnap(Line *ln, size_t x) {
+	/* Move x back to the start of the character it points into */
+	size_t off;
+	Node *t;
+
+	if (x >= ln->length) return ln->length;
+	if (!(t = mtfind(ln->pieces, 0, x, &off))) return x;
+	return x - (off - mutf8start(((Piece*)t)->data, t->len[0], off));
+}
+
+int mcharwidth(wchar_t c) {
+	/* Number of columns the terminal gives c, 0 for characters it
+	 * can't print on their own. The table is the same whatever the
+	 * locale, and a lot faster than wcwidth(). */
+	unsigned long u = (unsigned long)c;
+	if (u >= LENGTH(width_index) * 256) return 0;
+	/* ASCII is in the first block, which is always in the cache.
+	 * Checking for it first is slower on mixed text. */
+	return width_blocks[width_index[u >> 8]][(u & 0xff) >> 2] >> ((u & 3) * 2) & 3;
+}
+
+int mwidth(wchar_t c) {
+	/* Number of columns c takes up in mpaintln. Tabs and nulls are
+	 * tab_width wide, and nothing is less than one. */
+	int w;
+	if (c == L'\t' || !c) return tab_width;
+	return (w = mcharwidth(c)) ? w : 1;
+}
+
+uint64_t mscan64(const char *s, uint64_t *high) {
+	/* Portable version: one bit per newline in the 64 bytes at s,
+	 * and one per byte with the high bit set in high */
+	uint64_t nl = 0, hi = 0;
+	int i;
+	for (i = 0; i < 64; ++i) {
+		nl |= (uint64_t)(s[i] == '\n') << i;
+		hi |= (uint64_t)((unsigned char)s[i] >> 7) << i;
+	}
+	*high = hi;
+	return nl;
+}
+
+#ifdef MSCAN_X86
+uint64_t mscan64sse2(const char *s, uint64_t *high) {
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint64_t nl = 0, hi = 0;
+	int i;
+	for (i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + i * 16));
+		nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << (i * 16);
+		hi |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << (i * 16);
+	}
+	*high = hi;
+	return nl;
+}
+
+__attribute__((target("avx2")))
+uint64_t mscan64avx2(const char *s, uint64_t *high) {
+	const __m256i lf = _mm256_set1_epi8('\n');
+	__m256i a = _mm256_loadu_si256((const __m256i*)s);
+	__m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+	*high = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+	return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, lf))
+		| (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, lf)) << 32;
+}
+#endif
+
+void mscaninit() {
+	/* Pick the widest kernel the CPU can run */
+#ifdef MSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) mscanner = mscan64sse2;
+	if (__builtin_cpu_supports("avx2")) mscanner = mscan64avx2;
+#endif
+}
+
+size_t mscan(const char *s, size_t n, bool last, size_t *eol, size_t *cnt, size_t *bad) {
+	/* Store the offset of every newline in s in eol, and count the
+	 * bytes that aren't valid UTF-8 in bad. Returns how far s was
+	 * checked: unless this is the last part of the file, a character
+	 * cut off at the end is left for the next call. */
+	char tail[64];
+	size_t i, v = 0;
+
+	for (i = 0; i < n; i += 64) {
+		const char *b = s + i;
+		uint64_t m, hi;
+		if (n - i < 64) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, b, n - i);
+			b = tail;
+		}
+		for (m = mscanner(b, &hi); m; m &= m - 1)
+			eol[(*cnt)++] = i + __builtin_ctzll(m);
+
+		/* Only look at the bytes one by one when there are non-ASCII
+		 * ones, or a character from the last block is still open */
+		if (!hi && v <= i) {
+			v = i + 64;
+			continue;
+		}
+		while (v < i + 64 && v < n) {
+			wchar_t c;
+			unsigned char u;
+			int len;
+			/* Skip to the next byte with the high bit set */
+			if (!(m = hi >> (v - i))) {
+				v = i + 64;
+				break;
+			}
+			v += __builtin_ctzll(m);
+			u = s[v];
+			len = mutf8dec(s + v, n - v, &c);
+			if (len == 1) {
+				/* Maybe it's only cut off */
+				int want = u >> 5 == 6 ? 2 : u >> 4 == 14 ? 3 : u >> 3 == 30 ? 4 : 1;
+				if (!last && v + want > n) {
+					size_t j = v + 1;
+					while (j < n && (s[j] & 0xC0) == 0x80) j++;
+					if (j == n) return v;
+				}
+				(*bad)++;
+			}
+			v += len;
+		}
+	}
+	return v < n ? v : n;
+}
+
+void* mpoolget(Pool *pool) {
+	/* Zeroed object, from the free list or the newest slab */
+	void *p;
+	Slab *s = pool->slabs;
+	if ((p = pool->free)) {
+		pool->free = *(void**)p;
+		pool->nfree--;
+	} else {
+		if (!s || s->used == s->cap) {
+			size_t cap = s ? s->cap * 2 : default_slab_size / pool->size;
+			if (cap * pool->size > max_slab_size) cap = max_slab_size / pool->size;
+			if (!(s = (Slab*)malloc(sizeof(Slab) + cap * pool->size))) return NULL;
+			s->cap = cap;
+			s->used = 0;
+			s->next = pool->slabs;
+			pool->slabs = s;
+			pool->nslabs++;
+			pool->cap += cap;
+		}
+		p = s->data + s->used++ * pool->size;
+	}
+	return memset(p, 0, pool->size);
+}
+
+void mpoolput(Pool *pool, void *p) {
+	*(void**)p = pool->free;
+	pool->free = p;
+	pool->nfree++;
+}
+
+void mpoolclear(Pool *pool) {
+	/* Release every object at once */
+	while (pool->slabs) {
+		Slab *next = pool->slabs->next;
+		free(pool->slabs);
+		pool->slabs = next;
+	}
+	pool->free = NULL;
+	pool->nfree = pool->nslabs = pool->cap = 0;
+}
+
+const char* maddtext(Buffer *buf, const char *str, size_t n) {
+	/* Append to the add buffer. Blocks are never moved or
+	 * modified, so pieces can point straight into them. */
+	Block *b = buf->add;
+	if (!b || b->cap - b->len < n) {
+		/* Every block is twice as big as the last one */
+		size_t cap = b ? 2 * b->cap : default_addblock_size;
+		if (cap > max_addblock_size) cap = max_addblock_size;
+		if (cap < n) cap = n;
+		if (!(b = (Block*)malloc(sizeof(Block) + cap))) return NULL;
+		b->next = buf->add;
+		b->len = 0;
+		b->cap = cap;
+		buf->add = b;
+	}
+	memcpy(b->data + b->len, str, n);
+	b->len += n;
+	return b->data + b->len - n;
+}
+
+Piece* mnewpiece(Buffer *buf, const char *data, size_t n) {
+	Piece *p;
+	if (!(p = (Piece*)mpoolget(&buf->piecepool))) return NULL;
+	p->n.prio = mtprio();
+	p->n.len[0] = p->n.sum[0] = n;
+	p->data = data;
+	return p;
+}
+
+Node* mnewtext(Buffer *buf, const char *s, size_t n) {
+	/* Pieces for n bytes of text, cut between characters so that
+	 * none is longer than piece_size. Their columns are left to
+	 * mmeasure. */
+	Node *t = NULL;
+	size_t cut;
+	Piece *p;
+
+	for (; n; s += cut, n -= cut) {
+		cut = n;
+		if (cut > piece_size && !(cut = mutf8start(s, n, piece_size))) cut = piece_size;
+		if (!(p = mnewpiece(buf, s, cut))) {
+			mtfree(&buf->piecepool, t);
+			return NULL;
+		}
+		t = mtmerge(t, &p->n);
+	}
+	return mtroot(t);
+}
+
+size_t mspancols(const char *s, size_t n, bool *plain) {
+	/* Columns taken up by n bytes of text, and in plain whether
+	 * every character is one byte and one column */
+	size_t x = 0, cols = 0;
+	bool p = true;
+	wchar_t c;
+	int len, w;
+
+	while (x < n) {
+		/* Printable ASCII is most of it */
+		if (s[x] >= 0x20 && s[x] < 0x7f) {
+			x++;
+			cols++;
+			continue;
+		}
+		len = mutf8dec(s + x, n - x, &c);
+		w = mwidth(c);
+		p = p && len == 1 && w == 1;
+		x += len;
+		cols += w;
+	}
+	*plain = p;
+	return cols;
+}
+
+void mmeasure(Node *t) {
+	/* Give every piece of t its columns. That only happens once a
+	 * line is laid out, so loading files doesn't have to. */
+	if (t) {
+		Piece *p = (Piece*)t;
+		t->len[1] = mspancols(p->data, t->len[0], &p->plain);
+		mmeasure(t->l);
+		mmeasure(t->r);
+		mtfix(t);
+	}
+}
+
+void mtmatch(Node *a, Node *b) {
+	/* The pieces of a line all know their columns or none do, so
+	 * before two trees of them are joined, measure one of them if
+	 * only the other one is */
+	if (a && b && !a->sum[1] != !b->sum[1]) mmeasure(a->sum[1] ? b : a);
+}
+
+void mlncut(Buffer *buf, Line *ln, size_t idx) {
+	/* Make sure a piece starts at idx */
+	Node *t, *a, *b;
+	Piece *p, *q;
+	size_t off;
+
+	if (!idx || idx >= ln->length) return;
+	if (!(t = mtfind(ln->pieces, 0, idx, &off)) || !off) return;
+	q = (Piece*)t;
+	if (!(p = mnewpiece(buf, q->data + off, t->len[0] - off))) return;
+	if (t->len[1]) {
+		/* Measure both halves, the cut need not even be between
+		 * two characters. Plain pieces stay plain. */
+		size_t head = off, tail = p->n.len[0];
+		if (!(p->plain = q->plain)) {
+			head = mspancols(q->data, off, &q->plain);
+			tail = mspancols(p->data, tail, &p->plain);
+		}
+		p->n.len[1] = p->n.sum[1] = tail;
+		mtgrow(t, 1, (long)head - (long)t->len[1]);
+	}
+	mtgrow(t, 0, -(long)(t->len[0] - off));
+	mtsplit(ln->pieces, 0, idx, &a, &b);
+	ln->pieces = mtroot(mtmerge(mtmerge(a, &p->n), b));
+}
+
+const char* mlninsert(Buffer *buf, Line *ln, size_t idx, const char *str, size_t n) {
+	/* Returns where the text was put */
+	const char *data;
+	Node *t, *a, *b;
+
+	if (!n || !(data = maddtext(buf, str, n))) return NULL;
+	if (idx > ln->length) idx = ln->length;
+
+	if (idx) {
+		/* Typing usually continues the piece before the cursor */
+		size_t off;
+		Piece *p = (Piece*)(t = mtfind(ln->pieces, 0, idx - 1, &off));
+		if (off + 1 == t->len[0] && p->data + t->len[0] == data && t->len[0] + n <= piece_size) {
+			if (t->len[1]) {
+				/* Unless the piece is plain, a character
+				 * might go on into the new text */
+				size_t cols = p->plain ? t->len[1] + mspancols(data, n, &p->plain)
+						: mspancols(p->data, t->len[0] + n, &p->plain);
+				mtgrow(t, 1, (long)cols - (long)t->len[1]);
+			}
+			mtgrow(t, 0, n);
+			mlngrow(ln, n);
+			return data;
+		}
+	}
+
+	if (!(t = mnewtext(buf, data, n))) return NULL;
+	mlncut(buf, ln, idx);
+	mtmatch(ln->pieces, t);
+	mtsplit(ln->pieces, 0, idx, &a, &b);
+	ln->pieces = mtroot(mtmerge(mtmerge(a, t), b));
+	mlngrow(ln, n);
+	return data;
+}
+
+void mlnerase(Buffer *buf, Line *ln, size_t idx, size_t n) {
+	/* The text stays where it is, only the pieces are dropped */
+	Node *a, *b, *c;
+	if (idx >= ln->length) return;
+	if (n > ln->length - idx) n = ln->length - idx;
+	mlncut(buf, ln, idx);
+	mlncut(buf, ln, idx + n);
+	mtsplit(ln->pieces, 0, idx, &a, &b);
+	mtsplit(b, 0, n, &b, &c);
+	mtfree(&buf->piecepool, b);
+	ln->pieces = mtroot(mtmerge(a, c));
+	mlngrow(ln, -(long)n);
+}
+
+Node* mlnsplit(Buffer *buf, Line *ln, size_t idx) {
+	/* Detach and return everything from idx onwards */
+	Node *a, *b;
+	if (idx > ln->length) idx = ln->length;
+	mlncut(buf, ln, idx);
+	mtsplit(ln->pieces, 0, idx, &a, &b);
+	ln->pieces = mtroot(a);
+	mlngrow(ln, -(long)(ln->length - idx));
+	return mtroot(b);
+}
+
+void mlnjoin(Line *ln, Node *pieces) {
+	/* Append pieces to the end of the line */
+	if (pieces) mlngrow(ln, pieces->sum[0]);
+	mtmatch(ln->pieces, pieces);
+	ln->pieces = mtroot(mtmerge(ln->pieces, pieces));
+}
+
+size_t mlncopy(Line *ln, char *dst, size_t n) {
+	/* Copy up to n-1 bytes of the line to dst */
+	size_t len = 0;
+	Node *t;
+	if (!n) return 0;
+	for (t = mtfirst(ln->pieces); t && len < n - 1; t = mtnext(t)) {
+		size_t cnt = t->len[0] < n - 1 - len ? t->len[0] : n - 1 - len;
+		memcpy(dst + len, ((Piece*)t)->data, cnt);
+		len += cnt;
+	}
+	dst[len] = 0;
+	return len;
+}
+
+void mlngrow(Line *ln, long n) {
+	/* Keep the line index in sync with the length */
+	ln->length += n;
+	ln->gen = ++lngen;
+	mtgrow(&ln->n, 1, n);
+}
+
+Line* mnewln(Buffer *buf) {
+	Line *ln;
+	if (!(ln = (Line*)mpoolget(&buf->linepool))) return NULL;
+	ln->n.prio = mtprio();
+	ln->n.len[0] = ln->n.sum[0] = 1;
+	ln->n.len[1] = ln->n.sum[1] = 1;
+	ln->gen = ++lngen;
+	return ln;
+}
+
+Line* mlnafter(Buffer *buf, Line *prev) {
+	/* New empty line after prev */
+	Line *ln;
+	if (!(ln = mnewln(buf))) return NULL;
+	mlnlink(buf, prev, ln);
+	ln->next = prev->next;
+	ln->prev = prev;
+	if (prev->next) prev->next->prev = ln;
+	prev->next = ln;
+	return ln;
+}
+
+void mlnlink(Buffer *buf, Line *prev, Line *ln) {
+	/* Insert ln after prev in the line index */
+	Node *a, *b;
+	mtsplit(buf->index, 0, mlnidx(prev) + 1, &a, &b);
+	buf->index = mtroot(mtmerge(mtmerge(a, &ln->n), b));
+	buf->numlines++;
+}
+
+Line* mlnat(Buffer *buf, size_t n) {
+	/* Line number n, counting from 0 */
+	size_t off;
+	Line *ln = (Line*)mtfind(buf->index, 0, n, &off);
+	if (ln && ln->lazy) ln = mlnload(buf, ln, off);
+	return ln;
+}
+
+Line* mlnload(Buffer *buf, Line *blk, size_t k) {
+	/* Turn line k of an unloaded block into a real line. Whatever
+	 * is left of the block before and after it stays unloaded. */
+	const char *s = blk->lazy, *end = s + blk->n.len[1], *e;
+	size_t i, after = blk->n.len[0] - k - 1;
+	Line *ln, *rest = blk, *prev = blk->prev, *next = blk->next;
+	Node *a, *b, *c, *t;
+
+	for (i = 0; i < k; ++i) s = (const char*)memchr(s, '\n', end - s) + 1;
+	e = (const char*)memchr(s, '\n', end - s);
+	if (!(ln = mnewln(buf))) return NULL;
+	if (k && after && !(rest = mnewln(buf))) return NULL;
+	if (e > s) {
+		if (!(t = mnewtext(buf, s, e - s))) return NULL;
+		mlnjoin(ln, t);
+	}
+
+	/* Take the block out of the index... */
+	mtsplit(buf->index, 0, mlnidx(blk), &a, &b);
+	mtsplit(b, 0, blk->n.len[0], &b, &c);
+
+	/* ...and put back the pieces */
+	if (k) {
+		blk->n.len[0] = k;
+		blk->n.len[1] = s - blk->lazy;
+		a = mtmerge(a, mtfix(&blk->n));
+		prev = blk;
+	}
+	a = mtmerge(a, &ln->n);
+	if (after) {
+		rest->lazy = e + 1;
+		rest->n.len[0] = after;
+		rest->n.len[1] = end - e - 1;
+		rest->n.l = rest->n.r = NULL;
+		a = mtmerge(a, mtfix(&rest->n));
+		rest->prev = ln;
+		rest->next = next;
+		if (next) next->prev = rest;
+		next = rest;
+	} else if (!k) {
+		mpoolput(&buf->linepool, blk);
+	}
+	buf->index = mtroot(mtmerge(a, c));
+
+	ln->prev = prev;
+	ln->next = next;
+	if (prev) prev->next = ln;
+	if (next) next->prev = ln;
+	return ln;
+}
+
+Line* mnextln(Buffer *buf, Line *ln) {
+	/* Next line, loaded */
+	Line *next = ln->next;
+	if (next && next->lazy) next = mlnload(buf, next, 0);
+	return next;
+}
+
+Line* mprevln(Buffer *buf, Line *ln) {
+	/* Previous line, loaded */
+	Line *prev = ln->prev;
+	if (prev && prev->lazy) prev = mlnload(buf, prev, prev->n.len[0] - 1);
+	return prev;
+}
+
+size_t mlnidx(Line *ln) {
+	return mtpos(&ln->n, 0);
+}
+
+char* mlnstr(Line *ln) {
+	/* Null-terminated copy of the line, valid until the next call */
+	static char *str;
+	static size_t cap;
+	if (!mreserve((void**)&str, &cap, ln->length + 1)) return NULL;
+	mlncopy(ln, str, ln->length + 1);
+	return str;
+}
+
+const char* mlntext(Line *ln) {
+	/* Contiguous text of the line, not null-terminated. Lines made
+	 * of a single piece are returned without copying. */
+	if (!ln->pieces) return "";
+	if (!ln->pieces->l && !ln->pieces->r) return ((Piece*)ln->pieces)->data;
+	return mlnstr(ln);
+}
+
+int mreserve(void **p, size_t *cap, size_t n) {
+	/* Grow *p to hold at least n bytes, doubling its capacity */
+	size_t ncap;
+	void *np;
+	if (n <= *cap) return 1;
+	for (ncap = *cap ? *cap : 64; ncap < n; ncap *= 2);
+	if (!(np = realloc(*p, ncap))) return 0;
+	*p = np;
+	*cap = ncap;
+	return 1;
+}
+
 Buffer* mnewbuf() {
 	/* Create new buffer and insert at start of the list */
 	Buffer *next = NULL;
 	if (buflist) next = buflist;
 	if (!(buflist = (Buffer*)calloc(1, sizeof(Buffer)))) return NULL;
 	buflist->next = next;
+	buflist->linepool.size = sizeof(Line);
+	buflist->piecepool.size = sizeof(Piece);
 	/* Every buffer has at least one line */
-	buflist->curline = buflist->lines = (Line*)calloc(sizeof(wchar_t), sizeof(Line)+default_linebuf_size);
-	buflist->curline->length = default_linebuf_size;
+	mclearbuf(buflist);
 	buflist->offsetx = 4;
 	if (next) buflist->next->prev = buflist;
 	mselect(buflist, -1, -1, -1, -1);
@@ -243,124 +1364,811 @@ Buffer* mnewbuf() {
 
 void mfreebuf(Buffer *buf) {
 	if (!buf) return;
+	/* The changes are given up, so is their journal */
+	mswapclose(buf, false);
 	free(buf->path);
-	mclearbuf(buf);
-	free(buf->lines);
+	mfreetext(buf);
 	if (buf->prev) buf->prev->next = buf->next;
 	if (buf->next) buf->next->prev = buf->prev;
+	if (buflist == buf) buflist = buf->next;
 	if (curbuf == buf) curbuf = buf->next;
+	free(buf);
+}
+
+void mclearbuf(Buffer *buf) {
+	if (!buf) return;
+	mfreetext(buf);
+	buf->curline = buf->lines = mnewln(buf);
+	buf->index = &buf->lines->n;
+	buf->numlines = 1;
+	buf->cursor.c.x = buf->cursor.c.y = 0;
+	mdirty(buf, 0, SIZE_MAX);
+}
+
+void mfreetext(Buffer *buf) {
+	/* Lines and pieces go in a few calls, no need to walk them */
+	mloadfree(buf);
+	mjournalfree(&buf->undo);
+	mpoolclear(&buf->linepool);
+	mpoolclear(&buf->piecepool);
+	buf->curline = buf->lines = NULL;
+	buf->index = NULL;
+
+	/* No piece refers to the old text anymore */
+	while (buf->add) {
+		Block *next = buf->add->next;
+		free(buf->add);
+		buf->add = next;
+	}
+	if (buf->maplen) munmap(buf->orig, buf->maplen);
+	else free(buf->orig);
+	buf->orig = NULL;
+	buf->origlen = buf->maplen = 0;
+	buf->invalid = 0;
+	buf->partial = false;
+}
+
+int mreadfile(Buffer *buf, const char *path) {
+	FILE *fp = NULL;
+	struct stat st;
+
+	if (!buf || !path) return 0;
+	if (path[0] == '-' && !path[1]) {
+		fp = stdin;
+	} else {
+		fp = fopen(path, "r");
+	}
+
+	if (fp && !fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0
+			&& mreadasync(buf, fp, st.st_size)) {
+		/* The lines are added as they are found, fp is closed then */
+		fp = NULL;
+	} else if (fp && !mreadall(buf, fp)) {
+		fclose(fp);
+		return 0;
+	}
+
+	buf->path = (char*)calloc(1, strlen(path)+1);
+	buf->numlines = buf->index->sum[0];
+	mchecklines(buf);
+	strcpy(buf->path, path);
+	if (fp) fclose(fp);
+
+	/* Journals are checked against the file they were made for */
+	if (fp == stdin || stat(path, &buf->st)) memset(&buf->st, 0, sizeof(buf->st));
+	if (crash_journal && fp != stdin) {
+		char *swp = mswappath(path);
+		FILE *swap = swp ? fopen(swp, "r") : NULL;
+		if (swap && mswapmatch(buf, swap)) {
+			/* Kept as it is until it is recovered */
+			buf->swapstate = SWAP_PENDING;
+			mreadstr(cmdbuf, "Found unsaved changes to ");
+			mreadstr(cmdbuf, path);
+			mreadstr(cmdbuf, ", :recover brings them back\n");
+		}
+		if (swap) fclose(swap);
+		free(swp);
+	}
+
+	return 1;
+}
+
+int mreadall(Buffer *buf, FILE *fp) {
+	/* Read everything there is in fp, and only then make lines */
+	static size_t eol[1 << 16];
+	size_t j, n, off, done, cnt, start = 0, len = 0, cap = 0;
+	Line *ln = buf->lines;
+	Node *last = buf->index;
+	Node *t;
+
+	/* Keep the whole file around, lines only refer to it */
+	do {
+		if (!mreserve((void**)&buf->orig, &cap, len + BUFSIZ)) return 0;
+		len += (n = fread(buf->orig + len, 1, cap - len, fp));
+	} while (n);
+	buf->origlen = len;
+
+	for (off = 0; off < len; off += done) {
+		n = len - off < LENGTH(eol) ? len - off : LENGTH(eol);
+		cnt = 0;
+		done = mscan(buf->orig + off, n, off + n == len, eol, &cnt, &buf->invalid);
+		for (j = 0; j < cnt; ++j) {
+			size_t end = off + eol[j];
+			if (end > start) {
+				if (!(t = mnewtext(buf, buf->orig + start, end - start))) return 0;
+				mlnjoin(ln, t);
+			}
+			if (!(ln = mnewblock(buf, ln, &buf->index, &last, NULL, 1, 1))) return 0;
+			start = end + 1;
+		}
+	}
+	if (len > start) {
+		if (!(t = mnewtext(buf, buf->orig + start, len - start))) return 0;
+		mlnjoin(ln, t);
+	}
+	mtsum(buf->index);
+	return 1;
+}
+
+int mreadasync(Buffer *buf, FILE *fp, size_t len) {
+	/* Start looking for the lines of a file on other threads, which
+	 * mloadstep adds to the buffer as they are found. Apart from the
+	 * first and the last one, the lines are kept in blocks of
+	 * lazy_block_lines that mlnload splits up as needed, so a line
+	 * costs nothing until it is used. Big files are mapped, smaller
+	 * ones are read in whole. */
+	Load *ld;
+	void *map;
+	size_t i, n;
+
+	if (!(ld = (Load*)calloc(1, sizeof(Load)))) return 0;
+	if (len >= lazy_load_size
+			&& (map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) != MAP_FAILED) {
+		struct stat st;
+		buf->orig = (char*)map;
+		buf->maplen = len;
+		if (!fstat(fileno(fp), &st)) {
+			buf->mapdev = st.st_dev;
+			buf->mapino = st.st_ino;
+		}
+		ld->mapped = true;
+	} else if (!(buf->orig = (char*)malloc(len))) {
+		free(ld);
+		return 0;
+	}
+	buf->origlen = len;
+
+	/* Split the file at line starts, and scan every part on a thread
+	 * of its own */
+	n = load_threads ? load_threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > len / load_chunk_size) n = len / load_chunk_size;
+	if (!n) n = 1;
+	if (!(ld->chunks = (Chunk*)calloc(n, sizeof(Chunk)))) {
+		free(ld);
+		mclearbuf(buf);
+		return 0;
+	}
+	pthread_mutex_init(&ld->lock, NULL);
+	ld->fp = fp;
+	ld->len = len;
+	ld->orig = buf->orig;
+	ld->nchunks = n;
+	buf->load = ld;
+	for (i = 0; i < n; ++i) {
+		Chunk *c = &ld->chunks[i];
+		c->load = ld;
+		c->fd = fileno(fp);
+		c->per = lazy_block_lines;
+		c->from = c->pos = i ? ld->chunks[i-1].to : 0;
+		c->to = i + 1 < n ? mlinestart(c->fd, len / n * (i + 1), len) : len;
+		if (c->to < c->from) c->to = c->from;
+	}
+	ld->chunks[0].skip = 1;
+	for (i = 0; i < n; ++i) {
+		Chunk *c = &ld->chunks[i];
+		if (!(c->threaded = !pthread_create(&c->tid, NULL, mscanchunk, c)))
+			mscanchunk(c);
+	}
+	return 1;
+}
+
+size_t mlinestart(int fd, size_t off, size_t len) {
+	/* Offset of the first line starting at or after off */
+	char s[4096];
+	ssize_t n;
+	char *e;
+	if (!off) return 0;
+	for (off--; off < len && (n = pread(fd, s, sizeof(s), off)) > 0; off += n)
+		if ((e = (char*)memchr(s, '\n', n))) return off + (e - s) + 1;
+	return len;
+}
+
+void* mscanchunk(void *arg) {
+	/* Find the lines in one part of a file, and pass them on after
+	 * every read. Mapped files are read with pread() into a buffer
+	 * of its own, the mapping is only touched for lines that get
+	 * loaded. pos is where text starts in the file, keep the bytes
+	 * of a character carried over. */
+	const size_t size = 1 << 16;
+	Chunk *c = (Chunk*)arg;
+	Load *ld = c->load;
+	char *own = ld->mapped ? (char*)malloc(size) : NULL, *text;
+	size_t *eol = (size_t*)malloc(size * sizeof(size_t));
+	size_t j, n, done, found, end, pos = c->from, keep = 0, cnt = 0;
+	bool stop = !eol || (ld->mapped && !own), err = stop;
+	ssize_t r;
+
+	while (!stop && pos + keep < c->to) {
+		text = own ? own : ld->orig + pos;
+		n = c->to - pos - keep < size - keep ? c->to - pos - keep : size - keep;
+		if ((r = pread(c->fd, text + keep, n, pos + keep)) <= 0) break;
+		n = r + keep;
+		found = 0;
+		done = mscan(text, n, pos + n == c->to, eol, &found, &c->invalid);
+
+		pthread_mutex_lock(&ld->lock);
+		for (j = 0; j < found && !err; ++j) {
+			c->last = end = pos + eol[j] + 1;
+			if (c->skip) {
+				/* The first line is loaded, it's a block of its own */
+				c->skip--;
+			} else if (++cnt < c->per) {
+				continue;
+			}
+			if (!(err = !mreserve((void**)&c->cuts, &c->cap, (c->ncuts + 1) * sizeof(size_t))))
+				c->cuts[c->ncuts++] = end;
+			cnt = 0;
+		}
+		c->lines = cnt;
+		c->pos = pos + done;
+		stop = err || ld->cancel;
+		pthread_mutex_unlock(&ld->lock);
+
+		keep = n - done;
+		if (own) memmove(own, own + done, keep);
+		pos += done;
+	}
+
+	/* Stopping early is only an error if nobody asked for it */
+	pthread_mutex_lock(&ld->lock);
+	c->err = err || (!ld->cancel && pos + keep != c->to);
+	c->done = c->err || pos + keep == c->to;
+	pthread_mutex_unlock(&ld->lock);
+	free(own);
+	free(eol);
+	return NULL;
+}
+
+void mloadstep(Buffer *buf) {
+	/* Add the lines found so far to a buffer being loaded. They go
+	 * into a tree of their own, which is appended in one go. */
+	Load *ld = buf->load;
+	Node *batch = NULL, *last = NULL, *t;
+	Line *tail;
+	bool done, err = false;
+
+	for (t = buf->index; t->r; t = t->r);
+	tail = (Line*)t;
+	mdirty(buf, buf->numlines - 1, SIZE_MAX);
+
+	pthread_mutex_lock(&ld->lock);
+	for (; ld->next < ld->nchunks && tail; ld->next++, ld->used = 0) {
+		Chunk *c = &ld->chunks[ld->next];
+		for (; ld->used < c->ncuts && tail; ld->used++)
+			tail = mloadcut(buf, tail, &batch, &last, c->cuts[ld->used], c->per);
+		if (!tail) break;
+		if (!c->done && ld->cancel) {
+			/* Keep the lines found in this part, but nothing after */
+			size_t n = ld->cnt + c->lines, end = c->last ? c->last : ld->end;
+			if (n) tail = mnewblock(buf, tail, &batch, &last, ld->orig + ld->start, n, end - ld->start);
+			buf->invalid += c->invalid;
+			buf->partial = true;
+			ld->next = ld->nchunks;
+			break;
+		}
+		if (!c->done || (err = c->err)) break;
+		ld->cnt += c->lines;
+		if (c->last) ld->end = c->last;
+		buf->invalid += c->invalid;
+	}
+	done = ld->next == ld->nchunks;
+	pthread_mutex_unlock(&ld->lock);
+
+	if (done && !buf->partial && tail) {
+		/* The rest of the file, and the last line */
+		Line *ln = ld->started ? NULL : buf->lines;
+		if (ld->cnt && (tail = mnewblock(buf, tail, &batch, &last, ld->orig + ld->start,
+				ld->cnt, ld->end - ld->start)))
+			ld->start = ld->end;
+		if (!ln && tail) ln = tail = mnewblock(buf, tail, &batch, &last, NULL, 1, 1);
+		if (ln && ld->start < ld->len && (t = mnewtext(buf, ld->orig + ld->start, ld->len - ld->start)))
+			mlnjoin(ln, t);
+	}
+	err = err || !tail;
+
+	mtsum(batch);
+	if (batch) buf->numlines += batch->sum[0];
+	buf->index = mtroot(mtmerge(buf->index, batch));
+	mchecklines(buf);
+	if (done || err) mloadend(buf, err);
+}
+
+Line* mloadcut(Buffer *buf, Line *tail, Node **batch, Node **last, size_t end, size_t per) {
+	/* Add the line or block of lines that ends at end, and return
+	 * the new last line */
+	Load *ld = buf->load;
+	Node *t;
+
+	if (ld->started) {
+		tail = mnewblock(buf, tail, batch, last, ld->orig + ld->start, ld->cnt + per, end - ld->start);
+	} else if (end - 1 > ld->start) {
+		/* The first line already exists */
+		if (!(t = mnewtext(buf, ld->orig + ld->start, end - 1 - ld->start))) return NULL;
+		mlnjoin(buf->lines, t);
+	}
+	ld->started = true;
+	ld->start = end;
+	ld->cnt = 0;
+	return tail;
+}
+
+void mloadend(Buffer *buf, bool err) {
+	/* Stop loading. If something went wrong, e.g. the file shrank,
+	 * the lines loaded so far stay as they are, along with any edits
+	 * made to them, and the buffer counts as partly loaded. */
+	mloadfree(buf);
+	if (!err) return;
+	buf->partial = true;
+	mreadstr(cmdbuf, "Stopped loading ");
+	mreadstr(cmdbuf, buf->path);
+	mreadstr(cmdbuf, ", it changed or couldn't be read\n");
+	resize();
+}
+
+void mloadstop(Load *ld) {
+	/* Tell the threads of a load to stop, and wait for them */
+	size_t i;
+	pthread_mutex_lock(&ld->lock);
+	ld->cancel = true;
+	pthread_mutex_unlock(&ld->lock);
+	for (i = 0; i < ld->nchunks; ++i) {
+		if (ld->chunks[i].threaded) pthread_join(ld->chunks[i].tid, NULL);
+		ld->chunks[i].threaded = false;
+	}
+}
+
+void mloadfree(Buffer *buf) {
+	/* Stop loading, and forget about it */
+	Load *ld = buf->load;
+	size_t i;
+	if (!ld) return;
+	mloadstop(ld);
+	for (i = 0; i < ld->nchunks; ++i) free(ld->chunks[i].cuts);
+	pthread_mutex_destroy(&ld->lock);
+	if (ld->fp) fclose(ld->fp);
+	free(ld->chunks);
+	free(ld);
+	buf->load = NULL;
+}
+
+int mloadall() {
+	/* Add what was found to every buffer being loaded, and return
+	 * how many there were */
+	Buffer *buf;
+	int n = 0;
+	for (buf = buflist; buf; buf = buf->next) {
+		if (buf->load) {
+			mloadstep(buf);
+			n++;
+		}
+	}
+	return n;
+}
+
+int mloadprogress(Buffer *buf) {
+	/* How much of the file was looked at, in percent */
+	Load *ld = buf->load;
+	size_t i, n = 0;
+	pthread_mutex_lock(&ld->lock);
+	for (i = 0; i < ld->nchunks; ++i)
+		n += ld->chunks[i].pos - ld->chunks[i].from;
+	pthread_mutex_unlock(&ld->lock);
+	return n * 100 / ld->len;
+}
+
+Line* mnewblock(Buffer *buf, Line *prev, Node **root, Node **last, const char *s, size_t lines, size_t n) {
+	/* Append a block of lines that aren't loaded yet, or a real
+	 * line if s is NULL, to a buffer being loaded. The weights
+	 * are left alone, see mtpush. */
+	Line *ln;
+	if (!(ln = mnewln(buf))) return NULL;
+	ln->lazy = s;
+	ln->n.len[0] = lines;
+	ln->n.len[1] = n;
+	ln->prev = prev;
+	prev->next = ln;
+	mtpush(root, *last, &ln->n);
+	*last = &ln->n;
+	return ln;
+}
+
+int mwritebuf(Buffer *buf, int fd) {
+	/* Write the text of buf to fd straight from where it is kept.
+	 * Pieces are gathered into writev calls of up to IOV_MAX, and
+	 * pieces that follow each other in memory, like the lines of a
+	 * file that weren't edited, go out as one. */
+	struct iovec iov[IOV_MAX];
+	int n = 0;
+	Line *ln;
+	Node *t;
+
+	for (ln = buf->lines; ln; ln = ln->next) {
+		const char *end;
+		if (ln->lazy) {
+			/* Unloaded lines go out as they are, newlines included
+			 * unless it is the last of a partly loaded buffer */
+			if (!mgather(fd, iov, &n, ln->lazy, ln->n.len[1] - !ln->next)) return 0;
+			continue;
+		}
+		for (t = mtfirst(ln->pieces); t; t = mtnext(t))
+			if (!mgather(fd, iov, &n, ((Piece*)t)->data, t->len[0])) return 0;
+		if (!ln->next) break;
+
+		/* Take the newline from the file if it comes right after */
+		end = n ? (char*)iov[n-1].iov_base + iov[n-1].iov_len : NULL;
+		if (!end || end < buf->orig || end >= buf->orig + buf->origlen || *end != '\n')
+			end = "\n";
+		if (!mgather(fd, iov, &n, end, 1)) return 0;
+	}
+	return mflushv(fd, iov, n);
+}
+
+int mgather(int fd, struct iovec *iov, int *n, const char *s, size_t len) {
+	/* Add s to the n entries in iov, writing them out when full */
+	if (!len) return 1;
+	if (*n && (char*)iov[*n-1].iov_base + iov[*n-1].iov_len == s) {
+		iov[*n-1].iov_len += len;
+		return 1;
+	}
+	if (*n == IOV_MAX) {
+		if (!mflushv(fd, iov, *n)) return 0;
+		*n = 0;
+	}
+	iov[*n].iov_base = (void*)s;
+	iov[(*n)++].iov_len = len;
+	return 1;
 }
 
-void mclearbuf(Buffer *buf) {
-	Line *ln;
-	if (!buf || !buf->lines) return;
-	ln = buf->lines->next;
-	while (ln) {
-		Line *next = ln->next;
-		free(ln);
-		ln = next;
+int mflushv(int fd, struct iovec *iov, int n) {
+	/* writev may stop anywhere, so carry on from there */
+	while (n) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		for (; n && (size_t)w >= iov->iov_len; --n)
+			w -= iov++->iov_len;
+		if (n) {
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
 	}
-	buf->lines->data[0] = 0;
-	buf->lines->next = NULL;
-	buf->cursor.c.x = buf->cursor.c.y = 0;
-	buf->curline = buf->lines;
+	return 1;
 }
 
-int mreadfile(Buffer *buf, const char *path) {
-	FILE *fp = NULL;
+int msyncdir(const char *path) {
+	/* Flush the directory holding path */
+	const char *s = strrchr(path, '/');
+	char *dir = s ? strndup(path, s == path ? 1 : (size_t)(s - path)) : strdup(".");
+	int fd, err;
+	if (!dir) return 0;
+	fd = open(dir, O_RDONLY);
+	free(dir);
+	if (fd < 0) return 0;
+	err = fsync(fd);
+	close(fd);
+	return !err;
+}
 
-	if (!buf || !path) return 0;
-	if (path[0] == '-' && !path[1]) {
-		fp = stdin;
-	} else {
-		fp = fopen(path, "r");
+int mdetach(Buffer *buf) {
+	/* Put a copy of the file buf has mapped in place of the mapping,
+	 * so that the file can be overwritten. Truncating it would take
+	 * even pages that were written to away from the mapping. */
+	char *copy;
+	if (!buf->maplen || !buf->mapino) return 1;
+	copy = (char*)mmap(NULL, buf->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy == MAP_FAILED) return 0;
+	memcpy(copy, buf->orig, buf->maplen);
+	if (mmap(buf->orig, buf->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+			== MAP_FAILED) {
+		munmap(copy, buf->maplen);
+		return 0;
 	}
+	memcpy(buf->orig, copy, buf->maplen);
+	munmap(copy, buf->maplen);
+	mprotect(buf->orig, buf->maplen, PROT_READ);
+	buf->mapdev = buf->mapino = 0;
+	return 1;
+}
 
-	if (fp) {
-		wchar_t linecnt[default_linebuf_size];
-		Line *ln = buf->lines;
-		while (fgetws(linecnt, default_linebuf_size, fp) == linecnt) {
-			Line *curln = ln;
-			int len = wcslen(linecnt);
-			if (!curln) break;
-			wcsncpy(ln->data, linecnt, default_linebuf_size);
-			ln->data[len-1] = 0;
-			if (!(ln->next = (Line*)calloc(sizeof(Line)+default_linebuf_size*sizeof(wchar_t), 1))) return 0;
-			ln->length = default_linebuf_size;
-			ln = ln->next;
-			ln->prev = curln;
+int mbackup(const char *path, const char *dst, bool replaced) {
+	/* Keep the old contents of path at dst. If path is about to be
+	 * replaced by a new file, the old one is simply linked there.
+	 * Otherwise the data is shared with a reflink if the filesystem
+	 * allows it, or copied, in the kernel if possible. */
+	char buf[1 << 16];
+	ssize_t n;
+	int in, out;
+
+	unlink(dst);
+	if (replaced && !link(path, dst)) return 1;
+	if ((in = open(path, O_RDONLY)) < 0) return 0;
+#ifdef __linux__
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0) {
+		if (!ioctl(out, FICLONE, in)) {
+			close(in);
+			return !close(out);
 		}
+		close(out);
+		unlink(dst);
+	}
+#endif
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+		close(in);
+		return 0;
+	}
+#ifdef __linux__
+	while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+	/* Copy by hand if it isn't supported here */
+	if (n < 0 && !lseek(out, 0, SEEK_CUR))
+#endif
+		while ((n = read(in, buf, sizeof(buf))) > 0)
+			if (write(out, buf, n) != n) break;
+	close(in);
+	if (close(out) || n) {
+		unlink(dst);
+		return 0;
 	}
-
-	buf->path = (char*)calloc(1, strlen(path)+1);
-	buf->numlines = mnumlines(buf);
-	strcpy(buf->path, path);
-	if (fp) fclose(fp);
-
 	return 1;
 }
 
 void mreadstr(Buffer *buf, const char *str) {
-	int i, len, m = mode;
+	int m = mode;
+	size_t len;
 	if (!buf || !str) return;
 	len = strlen(str);
 	mode = MODE_INSERT;
-	for (i = 0; i < len; ++i)
-		minsert(buf, str[i]);
+	while (len) {
+		wchar_t c;
+		int n = mutf8dec(str, len, &c);
+		minsert(buf, c);
+		str += n;
+		len -= n;
+	}
 	mode = m;
 }
 
+#ifdef DEBUG
 int mnumlines(Buffer *buf) {
 	Line *ln;
 	int n = 0;
 	if (!buf) return 0;
 	ln = buf->lines;
 	while (ln) {
+		n += ln->n.len[0];
 		ln = ln->next;
-		n++;
 	}
 	return n;
 }
+#endif
+
+void mchecklines(Buffer *buf) {
+#ifdef DEBUG
+	/* The cached count must agree with both the list and the index */
+	assert(buf->numlines == mnumlines(buf));
+	assert((size_t)buf->numlines == buf->index->sum[0]);
+#else
+	(void)buf;
+#endif
+}
 
-int mnumvislines(Line *ln) {
+int mnumvislines(Buffer *buf, Line *ln) {
 	/* How many 'visual lines' will be needed
 	 * in order to display the physical line? */
-	int len, col;
-	col = getmaxx(bufwin);
-	len = wcslen(ln->data) + 4;
-	return col ? (len + col - 1) / col : 1;
+	Layout *l = mlayout(buf, ln);
+	return l->nrows ? l->nrows : 1;
+}
+
+Layout* mlayout(Buffer *buf, Line *ln) {
+	/* Rows of the lines on screen, worked out again only when they
+	 * change. Lines share slots by their address. With line_wrap,
+	 * they are cut into rows as wide as the window of buf past the
+	 * gutter, and characters that don't fit go on the next row. */
+	static Layout cache[256];
+	Layout *l = &cache[(uintptr_t)ln / sizeof(Line) % LENGTH(cache)];
+	int len, w, cols = line_wrap ? mtextcols(buf) : 0;
+	size_t pos = 0, col = 0, start = 0, x, c;
+	wchar_t ch;
+	Node *t;
+
+	if (l->ln == ln && l->gen == ln->gen && l->cols == cols) return l;
+	l->ln = ln;
+	l->gen = ln->gen;
+	l->cols = cols;
+	l->nrows = 0;
+	l->clip.w = 0;
+	if (ln->pieces && !ln->pieces->sum[1]) mmeasure(ln->pieces);
+	l->width = ln->pieces ? ln->pieces->sum[1] : 0;
+	if (mreserve((void**)&l->rows, &l->rcap, sizeof(*l->rows))) {
+		l->rows[0].pos = l->rows[0].col = 0;
+		l->nrows = 1;
+	}
+	for (t = mtfirst(ln->pieces); cols && t; pos += t->len[0], col += t->len[1], t = mtnext(t)) {
+		Piece *p = (Piece*)t;
+		for (x = 0, c = col; x < t->len[0]; x += len, c += w) {
+			if (p->plain) {
+				/* Every character is a column, so skip to
+				 * where the next row starts */
+				if (c < start + cols) c = start + cols;
+				if (c >= col + t->len[1]) break;
+				x = c - col;
+				len = w = 1;
+			} else {
+				len = mutf8dec(p->data + x, t->len[0] - x, &ch);
+				w = mwidth(ch);
+			}
+			if (c > start && c + w > start + cols
+					&& mreserve((void**)&l->rows, &l->rcap, (l->nrows + 1) * sizeof(*l->rows))) {
+				l->rows[l->nrows].pos = pos + x;
+				l->rows[l->nrows++].col = start = c;
+			}
+		}
+	}
+	return l;
+}
+
+size_t mlayoutrow(Layout *l, size_t x) {
+	/* Row of the line byte x is on */
+	size_t lo = 0, hi = l->nrows, mid;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (l->rows[mid].pos <= x) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+int mnumcols(Buffer *buf, Line *ln, int end) {
+	/* Count number of columns until cursor. The pieces before
+	 * it are summed up in the tree, only the last one is read. */
+	Layout *l = mlayout(buf, ln);
+	size_t off, x, n;
+	wchar_t c;
+	Piece *p;
+	int len;
+
+	if ((size_t)end >= ln->length || !(p = (Piece*)mtfind(ln->pieces, 0, end, &off))) return l->width;
+	n = mtpos(&p->n, 1);
+	if (p->plain) return n + off;
+	for (x = 0; x < off; x += len, n += mwidth(c))
+		len = mutf8dec(p->data + x, p->n.len[0] - x, &c);
+	return n;
+}
+
+size_t mcolbyte(Buffer *buf, Line *ln, size_t col, size_t *at) {
+	/* Start of the character at column col, and in at its own
+	 * column. Past the end, that is the end of the line. */
+	Layout *l = mlayout(buf, ln);
+	size_t off, x = 0, n;
+	wchar_t c;
+	Piece *p;
+	int len;
+
+	*at = l->width;
+	if (col >= l->width || !(p = (Piece*)mtfind(ln->pieces, 1, col, &off))) return ln->length;
+	*at = col;
+	if (p->plain) return mtpos(&p->n, 0) + off;
+	for (n = col - off; x < p->n.len[0]; x += len, n += mwidth(c)) {
+		len = mutf8dec(p->data + x, p->n.len[0] - x, &c);
+		if (n + mwidth(c) > col) break;
+	}
+	*at = n;
+	return mtpos(&p->n, 0) + x;
+}
+
+int mtextcols(Buffer *buf) {
+	/* Number of columns for text in the window of buf */
+	int cols = getmaxx(buf == cmdbuf ? cmdwin : bufwin) - buf->offsetx;
+	return cols < 1 ? 1 : cols;
+}
+
+int mcursorcol(Buffer *buf) {
+	/* Column of the cursor on its row, past the gutter */
+	int ncols = mnumcols(buf, buf->curline, buf->cursor.c.x);
+	Layout *l = mlayout(buf, buf->curline);
+
+	if (!line_wrap) return ncols - buf->startx;
+	return l->nrows ? ncols - (int)l->rows[mlayoutrow(l, buf->cursor.c.x)].col : ncols;
+}
+
+int mlayoutln(Buffer *buf, Row *rows, int row, int at, Line *ln, size_t y) {
+	/* Put the rows of line y on the screen from row at on,
+	 * return where the next line starts */
+	Layout *l = mlayout(buf, ln);
+	int k, n = l->nrows ? l->nrows : 1;
+
+	if (!line_wrap) {
+		/* Only what is between the edges, which is found
+		 * from the columns of the pieces */
+		int w = mtextcols(buf);
+		if (at < 0 || at >= row) return at + 1;
+		if (l->clip.x != buf->startx || l->clip.w != w) {
+			size_t last, end;
+			l->clip.x = buf->startx;
+			l->clip.w = w;
+			l->clip.from = mcolbyte(buf, ln, buf->startx, &l->clip.col);
+			last = mcolbyte(buf, ln, buf->startx + w - 1, &end);
+			l->clip.to = last < ln->length ? mlnnext(ln, last) : last;
+		}
+		rows[at].ln = ln;
+		rows[at].y = y;
+		rows[at].k = 0;
+		rows[at].left = buf->startx;
+		rows[at].from = l->clip.from;
+		rows[at].to = l->clip.to;
+		rows[at].col = l->clip.col;
+		return at + 1;
+	}
+	k = at < 0 ? min(n, -at) : 0;
+	for (at += k; k < n && at < row; ++k, ++at) {
+		rows[at].ln = ln;
+		rows[at].y = y;
+		rows[at].k = k;
+		rows[at].from = l->nrows ? l->rows[k].pos : 0;
+		rows[at].to = k + 1 < n ? l->rows[k + 1].pos : ln->length;
+		rows[at].col = rows[at].left = l->nrows ? l->rows[k].col : 0;
+	}
+	return at + n - k;
+}
+
+void mlayoutrows(Buffer *buf, Row *rows, int row) {
+	/* What goes on each of row rows. The cursor line starts at
+	 * cursor.c.y - starty, and the lines around it go on from
+	 * there. It all comes from the layouts of the lines. */
+	int i, cp = buf->cursor.c.y - buf->starty;
+	size_t y = mlnidx(buf->curline), k;
+	Line *ln;
+
+	for (i = 0; i < row; ++i) rows[i].ln = NULL;
+	/* From the cursor down... */
+	for (i = cp, k = 0, ln = buf->curline; i < row && ln; ++k, ln = mnextln(buf, ln))
+		i = mlayoutln(buf, rows, row, i, ln, y + k);
+	/* ...and up */
+	for (i = cp, k = 0, ln = buf->curline; i > 0 && (ln = mprevln(buf, ln)); ++k) {
+		i -= mnumvislines(buf, ln);
+		mlayoutln(buf, rows, row, i, ln, y - k - 1);
+	}
 }
 
-int mnumcols(Line *ln, int end) {
-	/* Count number of columns until cursor */
-	int i, ncols;
-	for (i = ncols = 0; i < end; ++i) {
-		if (ln->data[i] == L'\t') ncols += tab_width;
-		else ncols += max(0, wcwidth(ln->data[i]));
+size_t mrowbyte(const Row *r, int col) {
+	/* Byte of the character at column col of row r, or the end
+	 * of the row if it is shorter */
+	size_t n = r->col;
+	wchar_t c;
+	Iter it;
+
+	for (mitinit(&it, r->ln, r->from); it.pos < r->to; n += mwidth(c)) {
+		size_t pos = it.pos;
+		if (!mitnext(&it, &c)) break;
+		if (n + mwidth(c) > r->left + col) return pos;
 	}
-	return ncols;
+	/* The row goes on on the next one, unless the line ends */
+	return r->to < r->ln->length ? mlnprev(r->ln, r->to) : r->to;
 }
 
 void mupdatecursor() {
 	/* Place the cursor depending on the mode */
 	WINDOW *win = mode == MODE_COMMAND ? cmdwin : bufwin;
 	Buffer *buf = mode == MODE_COMMAND ? cmdbuf : curbuf;
-	int ncols = mnumcols(buf->curline, buf->cursor.c.x);
-	wmove(win, buf->cursor.c.y - buf->starty, buf->offsetx + ncols);
-	wrefresh(win);
+	size_t k = mlayoutrow(mlayout(buf, buf->curline), buf->cursor.c.x);
+	int x = min(mcursorcol(buf), mtextcols(buf) - 1);
+	wmove(win, buf->cursor.c.y - buf->starty + k, buf->offsetx + x);
+	wnoutrefresh(win);
 }
 
 void mcmdkey(wint_t key) {
-	/* Number keys (other than 0) are reserved for repetition */
+	/* Number keys (other than 0) are reserved for repetition. The
+	 * count isn't capped here, G and % take it as a line number. */
 	if (isdigit(key) && !(key == '0' && !repcnt)) {
-		repcnt = min(10 * repcnt + (key - '0'), max_cmd_repetition);
+		if (repcnt <= (SIZE_MAX - 9) / 10) repcnt = 10 * repcnt + (key - '0');
 	} else {
 		int i;
 		for (i = 0; i < (int)(sizeof(buffer_actions) / sizeof(Action)); ++i) {
 			if (key == (wint_t)buffer_actions[i].key) {
-				msetln(cmdbuf->curline, buffer_actions[i].cmd);
+				msetln(cmdbuf, cmdbuf->curline, buffer_actions[i].cmd);
 				mjump(cmdbuf, MARKER_END);
-				mrepeat(&buffer_actions[i], repcnt ? repcnt : 1);
+				mrepeat(&buffer_actions[i], repcnt);
 			}
 		}
 		repcnt = 0;
@@ -368,146 +2176,651 @@ void mcmdkey(wint_t key) {
 }
 
 void minsert(Buffer *buf, wint_t key) {
-	int idx, len;
+	int idx;
+	size_t y;
 	Line *ln;
 
 	if (!buf || !(ln = buf->curline)) return;
 
-	idx = buf->cursor.c.x;
-	len = (wcslen(ln->data)+1) * sizeof(wchar_t);
+	/* The cursor may be past the end if the line under it went */
+	idx = buf->cursor.c.x = min(buf->cursor.c.x, ln->length);
+	y = mlnidx(ln);
+	mdirty(buf, y, y + 1);
 
 	switch (key) {
 	case '\b':
 	case 127:
 	case KEY_BACKSPACE:
 		if (idx) {
-			memcpy(ln->data+idx-1, ln->data+idx, len);
-			buf->cursor.c.x--;
-		} else if (ln->prev) {
-			int plen = wcslen(ln->prev->data);
-			wcscpy(ln->prev->data+plen, ln->data);
-			mmove(buf, plen + buf->cursor.c.x, -1);
+			buf->cursor.c.x = mlnprev(ln, idx);
+			mrecord(buf, true, ln, buf->cursor.c.x, NULL, idx - buf->cursor.c.x);
+			mlnerase(buf, ln, buf->cursor.c.x, idx - buf->cursor.c.x);
+		} else if (mprevln(buf, ln)) {
+			int plen = ln->prev->length;
+			mdirty(buf, y - 1, SIZE_MAX);
+			mrecord(buf, true, ln->prev, plen, "\n", 1);
+			mlnjoin(ln->prev, mlnsplit(buf, ln, 0));
+			mmove(buf, 0, -1);
+			buf->cursor.c.x = plen;
 			buf->curline = ln->prev;
-			mfreeln(ln);
+			mfreeln(buf, ln);
 		}
 		break;
 	case KEY_DC:
-		memcpy(ln->data+idx, ln->data+idx+1, len);
+		mrecord(buf, true, ln, idx, NULL, mlnnext(ln, idx) - idx);
+		mlnerase(buf, ln, idx, mlnnext(ln, idx) - idx);
 		break;
 	case '\n':
 		{
 			int ox = 0;
 			Line *old = ln;
-			ln = (Line*)calloc(sizeof(wchar_t), sizeof(Line) + default_linebuf_size);
-			ln->next = old->next;
-			ln->prev = old;
-			if (old->next) old->next->prev = ln;
-			old->next = ln;
+			const char *nl;
+			mdirty(buf, y, SIZE_MAX);
+			if (!(ln = mlnafter(buf, old))) break;
+			mlnjoin(ln, mlnsplit(buf, old, idx));
+			/* Kept with the typed text, so the journal can join them */
+			if (buf != cmdbuf && (nl = maddtext(buf, "\n", 1)))
+				mrecord(buf, false, old, idx, nl, 1);
 
 			if (auto_indent) {
 				/* Indent to the last position */
-				int x, mx;
-				for (x = mx = 0; x < idx; ++x) {
-					if (old->data[x] == L'\t') mx += tab_width;
-					else if (iswspace(old->data[x])) mx++;
-					else break;
+				int x, mx = 0;
+				Node *t;
+				for (t = mtfirst(old->pieces), x = 0; t && x < idx; t = mtnext(t)) {
+					const char *data = ((Piece*)t)->data;
+					size_t j;
+					for (j = 0; j < t->len[0] && x < idx; ++j, ++x) {
+						if (data[j] == '\t') mx += tab_width;
+						else if (isspace((unsigned char)data[j])) mx++;
+						else break;
+					}
+					if (j < t->len[0]) break;
 				}
-				ox = mindent(ln, mx);
+				ox = mindent(buf, ln, mx);
 			}
 
-			memcpy(ln->data+ox, old->data+idx, len);
-			old->data[idx] = 0;
 			mjump(buf, MARKER_START);
 			mmove(buf, ox, +1);
 
 			if (mode == MODE_COMMAND) {
-				mruncmd(cmdbuf->curline->prev->data);
+				/* Commands may use mlnstr, so run on a copy */
+				Line *cl = cmdbuf->curline->prev;
+				char *cmd = (char*)malloc(cl->length + 1);
+				if (cmd) {
+					mlncopy(cl, cmd, cl->length + 1);
+					mruncmd(cmd);
+				}
+				free(cmd);
 				resize();
 			}
 		}
 		break;
 	default:
 		{
-			memcpy(ln->data+idx+1, ln->data+idx, len);
-			ln->data[idx] = key;
-			buf->cursor.c.x++;
+			char c[4];
+			int n = mutf8enc(key, c);
+			mrecord(buf, false, ln, idx, mlninsert(buf, ln, idx, c, n), n);
+			buf->cursor.c.x += n;
 		}
 		break;
 	}
 
-	buf->numlines = mnumlines(buf);
+	mchecklines(buf);
+}
+
+void minserttext(Buffer *buf, const char *s, size_t n) {
+	/* Insert text at the cursor as one edit, newlines and all,
+	 * and put the cursor after it */
+	Edit e = { 0 };
+	Line *ln;
+	const char *t;
+
+	if (!buf || !(ln = buf->curline) || !n || !(t = maddtext(buf, s, n))) return;
+	e.y = mlnidx(ln);
+	e.x = buf->cursor.c.x = min(buf->cursor.c.x, ln->length);
+	if (!mspan(&e, t, n)) return;
+	buf->undo.sealed = true;
+	mrecord(buf, false, ln, e.x, t, n);
+	buf->undo.sealed = true;
+	mtextins(buf, &e);
+	mchecklines(buf);
+
+	e.ey = e.y;
+	e.ex = e.x;
+	mtextend(&e.ey, &e.ex, &e);
+	free(e.spans);
+	if (e.ey == e.y) buf->cursor.c.x = e.ex;
+	else mgotopos(buf, e.ey, e.ex);
+}
+
+char* mreadpaste(size_t *n) {
+	/* Read pasted text up to the end marker, straight from the
+	 * terminal. Curses stops reading at the start marker, and
+	 * gets back whatever came after the end. */
+	static const char end[] = "\033[201~";
+	const size_t elen = sizeof(end) - 1;
+	struct pollfd pfd = { STDERR_FILENO, POLLIN, 0 };
+	size_t cap = 0, i, j;
+	char *s = NULL, *m = NULL;
+	ssize_t got;
+
+	*n = 0;
+	while (!m) {
+		if (!mreserve((void**)&s, &cap, *n + 65536)) break;
+		/* Give up if the rest doesn't come */
+		if (poll(&pfd, 1, 1000) <= 0) break;
+		if ((got = read(STDERR_FILENO, s + *n, 65536)) <= 0) {
+			if (got < 0 && errno == EINTR) continue;
+			break;
+		}
+		/* The marker may be split over two reads */
+		i = *n > elen ? *n - elen : 0;
+		*n += got;
+		for (; i + elen <= *n && !m; ++i)
+			if (s[i] == end[0] && !memcmp(s + i, end, elen)) m = s + i;
+	}
+	if (m) {
+		for (i = *n; i > (size_t)(m - s) + elen; --i)
+			ungetch((unsigned char)s[i - 1]);
+		*n = m - s;
+	}
+
+	/* Terminals send returns for newlines */
+	for (i = j = 0; s && i < *n; ++i) {
+		if (s[i] == '\r' && i + 1 < *n && s[i + 1] == '\n') continue;
+		s[j++] = s[i] == '\r' ? '\n' : s[i];
+	}
+	*n = j;
+	return s;
 }
 
-int mindent(Line *ln, int n) {
+int mindent(Buffer *buf, Line *ln, int n) {
 	int i, j, tabs, spaces;
 
 	tabs = n / tab_width;
 	spaces = n % tab_width;
 
+	/* Consecutive inserts end up in the same piece */
 	for (i = 0; i < tabs; ++i)
-		ln->data[i] = L'\t';
+		mrecord(buf, false, ln, i, mlninsert(buf, ln, i, "\t", 1), 1);
 	for (j = 0; j < spaces; ++j)
-		ln->data[i+j] = L' ';
+		mrecord(buf, false, ln, i+j, mlninsert(buf, ln, i+j, " ", 1), 1);
 
 	return tabs + spaces;
 }
 
-void mfreeln(Line *ln) {
+void mfreeln(Buffer *buf, Line *ln) {
 	if (ln) {
+		Node *a, *b, *c;
+		size_t idx = mlnidx(ln);
+		mtsplit(buf->index, 0, idx, &a, &b);
+		mtsplit(b, 0, 1, &b, &c);
+		buf->index = mtroot(mtmerge(a, c));
 		if (ln->prev)
 			ln->prev->next = ln->next;
 		if (ln->next)
 			ln->next->prev = ln->prev;
-		free(ln);
+		mtfree(&buf->piecepool, ln->pieces);
+		mpoolput(&buf->linepool, ln);
+		buf->numlines--;
+	}
+}
+
+void msetln(Buffer *buf, Line *ln, const char *data) {
+	if (ln && data) {
+		size_t y = mlnidx(ln);
+		mdirty(buf, y, y + 1);
+		mlnerase(buf, ln, 0, ln->length);
+		mlninsert(buf, ln, 0, data, strlen(data));
+	}
+}
+
+void mrecord(Buffer *buf, bool del, Line *ln, size_t x, const char *s, size_t n) {
+	/* Journal n bytes inserted at or deleted from x in ln. The text
+	 * is s, or for deletions, whatever is there if s is NULL. */
+	Edit e = { 0 };
+	size_t off;
+	Node *t;
+
+	if (buf == cmdbuf || !n || (!del && !s)) return;
+	e.y = mlnidx(ln);
+	e.x = x;
+	e.del = del;
+	if (s) {
+		if (!mspan(&e, s, n)) return;
+	} else {
+		for (t = mtfind(ln->pieces, 0, x, &off); t && n; t = mtnext(t), off = 0) {
+			size_t cnt = t->len[0] - off < n ? t->len[0] - off : n;
+			if (!mspan(&e, ((Piece*)t)->data + off, cnt)) {
+				free(e.spans);
+				return;
+			}
+			n -= cnt;
+		}
+	}
+	e.ey = e.y;
+	e.ex = e.x;
+	mtextend(&e.ey, &e.ex, &e);
+	mswaplog(buf, del, &e);
+	mjournal(buf, &e);
+}
+
+int mspan(Edit *e, const char *s, size_t n) {
+	/* Add text to an edit, in place */
+	Span *last = e->nspans ? &e->spans[e->nspans - 1] : NULL;
+	e->len += n;
+	if (last && last->data + last->len == s) {
+		last->len += n;
+		return 1;
+	}
+	if (!mreserve((void**)&e->spans, &e->cap, (e->nspans + 1) * sizeof(Span))) return 0;
+	e->spans[e->nspans++] = (Span){ s, n };
+	return 1;
+}
+
+void mtextend(size_t *y, size_t *x, const Edit *e) {
+	/* Move a position past the text of e */
+	size_t i;
+	for (i = 0; i < e->nspans; ++i) {
+		const char *s = e->spans[i].data, *end = s + e->spans[i].len, *nl;
+		while ((nl = (const char*)memchr(s, '\n', end - s))) {
+			++*y;
+			*x = 0;
+			s = nl + 1;
+		}
+		*x += end - s;
+	}
+}
+
+void mjournal(Buffer *buf, Edit *e) {
+	/* Add e to the journal, or to the last edit if it continues it */
+	Journal *j = &buf->undo;
+	Edit *last = j->done ? &j->edits[j->done - 1] : NULL;
+	bool join;
+	size_t i;
+
+	/* Whatever was undone can't be redone anymore */
+	for (; j->n > j->done; --j->n) {
+		j->size -= sizeof(Edit) + j->edits[j->n - 1].cap;
+		free(j->edits[j->n - 1].spans);
+	}
+
+	join = last && !j->sealed && last->del == e->del;
+	if (join && (e->del ? last->y == e->y && last->x == e->x
+			: last->ey == e->y && last->ex == e->x)) {
+		/* Typing on, or deleting forwards */
+		j->size -= last->cap;
+		for (i = 0; i < e->nspans; ++i)
+			mspan(last, e->spans[i].data, e->spans[i].len);
+		mtextend(&last->ey, &last->ex, e);
+		j->size += last->cap;
+		free(e->spans);
+	} else if (join && e->del && e->ey == last->y && e->ex == last->x) {
+		/* Deleting backwards */
+		j->size -= last->cap;
+		for (i = 0; i < last->nspans; ++i)
+			mspan(e, last->spans[i].data, last->spans[i].len);
+		free(last->spans);
+		last->spans = e->spans;
+		last->nspans = e->nspans;
+		last->cap = e->cap;
+		last->len = e->len;
+		last->y = e->y;
+		last->x = e->x;
+		j->size += last->cap;
+	} else if (mreserve((void**)&j->edits, &j->cap, (j->n + 1) * sizeof(Edit))) {
+		j->edits[j->n++] = *e;
+		j->done = j->n;
+		j->size += sizeof(Edit) + e->cap;
+	} else {
+		free(e->spans);
+	}
+	j->sealed = false;
+
+	/* Forget the oldest edits when over budget */
+	for (i = 0; j->size > undo_budget && j->n - i > 1; ++i) {
+		j->size -= sizeof(Edit) + j->edits[i].cap;
+		free(j->edits[i].spans);
+	}
+	if (i) {
+		memmove(j->edits, j->edits + i, (j->n - i) * sizeof(Edit));
+		j->n -= i;
+		j->done -= i;
+	}
+}
+
+void mjournalfree(Journal *j) {
+	size_t i;
+	for (i = 0; i < j->n; ++i) free(j->edits[i].spans);
+	free(j->edits);
+	memset(j, 0, sizeof(*j));
+}
+
+void mundo(Buffer *buf, bool redo) {
+	/* Undo the last edit, or redo the last one undone */
+	Journal *j = &buf->undo;
+	Edit *e;
+
+	if (redo ? j->done == j->n : !j->done) return;
+	e = &j->edits[redo ? j->done++ : --j->done];
+	if (e->del != redo) mtextins(buf, e);
+	else mtextdel(buf, e->y, e->x, e->len);
+	mswaplog(buf, e->del == redo, e);
+	j->sealed = true;
+	mchecklines(buf);
+
+	/* Go to where it happened */
+	mgotopos(buf, e->y, e->x);
+}
+
+void mtextins(Buffer *buf, const Edit *e) {
+	/* Put the text of e back where it was. The pieces point to
+	 * the same text as before, nothing is copied. */
+	Line *ln = mlnat(buf, e->y);
+	Node *rest;
+	size_t i;
+
+	if (!ln) return;
+	mdirty(buf, e->y, SIZE_MAX);
+	rest = mlnsplit(buf, ln, e->x);
+	for (i = 0; i < e->nspans; ++i) {
+		const char *s = e->spans[i].data, *end = s + e->spans[i].len;
+		while (s < end) {
+			const char *nl = (const char*)memchr(s, '\n', end - s);
+			const char *to = nl ? nl : end;
+			Node *t;
+			if (to > s && (t = mnewtext(buf, s, to - s))) mlnjoin(ln, t);
+			if (nl && !(ln = mlnafter(buf, ln))) return;
+			s = to + !!nl;
+		}
+	}
+	mlnjoin(ln, rest);
+}
+
+void mtextdel(Buffer *buf, size_t y, size_t x, size_t n) {
+	/* Delete n bytes from x in line y, newlines included */
+	Line *ln = mlnat(buf, y), *next;
+
+	mdirty(buf, y, SIZE_MAX);
+	while (ln && n) {
+		size_t cnt = ln->length - x < n ? ln->length - x : n;
+		mlnerase(buf, ln, x, cnt);
+		if (!(n -= cnt) || !(next = mnextln(buf, ln))) break;
+		mlnjoin(ln, mlnsplit(buf, next, 0));
+		if (buf->curline == next) buf->curline = ln;
+		mfreeln(buf, next);
+		n--;
+	}
+}
+
+char* mswappath(const char *path) {
+	/* The crash journal of path is .name.mett next to it */
+	const char *base = strrchr(path, '/');
+	size_t dir = base ? (size_t)(++base - path) : 0;
+	char *swp;
+	if (!base) base = path;
+	if (!(swp = (char*)malloc(strlen(path) + 7))) return NULL;
+	sprintf(swp, "%.*s.%s.mett", (int)dir, path, base);
+	return swp;
+}
+
+int mswapopen(Buffer *buf, const char *mode) {
+	/* Start logging the edits of buf, or carry on with an old log.
+	 * The log names the file it applies to by size and time. A log
+	 * still waiting for :recover is never started over. */
+	char *swp;
+	if (buf->swap) return 1;
+	if (!crash_journal || buf == cmdbuf || !buf->path || !strcmp(buf->path, "-")) return 0;
+	if (buf->swapstate == SWAP_FAILED || (*mode == 'w' && buf->swapstate != SWAP_OFF)) return 0;
+	if (!(swp = mswappath(buf->path))) return 0;
+	buf->swap = fopen(swp, mode);
+	free(swp);
+	if (!buf->swap) {
+		/* Not tried again on every edit */
+		buf->swapstate = SWAP_FAILED;
+		return 0;
+	}
+	setvbuf(buf->swap, NULL, _IOFBF, 1 << 16);
+	if (*mode == 'w') {
+		fprintf(buf->swap, "mett journal\n%lld %lld %ld\n", (long long)buf->st.st_size,
+				(long long)buf->st.st_mtim.tv_sec, buf->st.st_mtim.tv_nsec);
+	}
+	return 1;
+}
+
+bool mswapmatch(Buffer *buf, FILE *fp) {
+	/* Whether the journal in fp was made for the file as it is */
+	long long size, sec;
+	long nsec;
+	return fscanf(fp, "mett journal %lld %lld %ld", &size, &sec, &nsec) == 3 && getc(fp) == '\n'
+		&& size == (long long)buf->st.st_size && sec == (long long)buf->st.st_mtim.tv_sec
+		&& nsec == buf->st.st_mtim.tv_nsec;
+}
+
+void mswaplog(Buffer *buf, bool del, const Edit *e) {
+	/* Log an edit as "d y x n", or as "i y x n" and the text. Runs
+	 * of inserts are logged as one, with the text copied only then. */
+	Edit *run = &buf->swaprun;
+	size_t i;
+
+	if (buf->swapstate == SWAP_PENDING) buf->swapstate = SWAP_HELD;
+	if (!mswapopen(buf, "w")) return;
+	buf->swapdirty = true;
+	if (del || !run->len || run->ey != e->y || run->ex != e->x) {
+		mswapput(buf);
+		if (del) {
+			fprintf(buf->swap, "d %zu %zu %zu\n", e->y, e->x, e->len);
+			return;
+		}
+		run->y = run->ey = e->y;
+		run->x = run->ex = e->x;
+	}
+	for (i = 0; i < e->nspans; ++i)
+		mspan(run, e->spans[i].data, e->spans[i].len);
+	mtextend(&run->ey, &run->ex, e);
+}
+
+void mswapput(Buffer *buf) {
+	/* Log the inserts collected so far */
+	Edit *run = &buf->swaprun;
+	size_t i;
+	if (!run->len) return;
+	fprintf(buf->swap, "i %zu %zu %zu\n", run->y, run->x, run->len);
+	for (i = 0; i < run->nspans; ++i)
+		fwrite(run->spans[i].data, 1, run->spans[i].len, buf->swap);
+	run->len = run->nspans = 0;
+}
+
+void mswapclose(Buffer *buf, bool keep) {
+	/* Stop logging, and remove the log unless it is still needed */
+	char *swp;
+	if (!buf->swap) return;
+	mswapput(buf);
+	fclose(buf->swap);
+	free(buf->swaprun.spans);
+	memset(&buf->swaprun, 0, sizeof(Edit));
+	buf->swap = NULL;
+	buf->swapdirty = false;
+	if (!keep && (swp = mswappath(buf->path))) {
+		unlink(swp);
+		free(swp);
 	}
 }
 
-void msetln(Line *ln, const wchar_t *data) {
-	if (ln && data) wcscpy(ln->data, data);
+int mswapsync() {
+	/* Write out the crash journals, at most every journal_flush_ms.
+	 * Returns the time until they are due, or -1 if nothing is. */
+	static long last;
+	long now = mclock();
+	bool dirty = false;
+	Buffer *b;
+
+	for (b = buflist; b; b = b->next) dirty |= b->swapdirty;
+	if (!dirty) return -1;
+	if (now - last < journal_flush_ms) return journal_flush_ms - (now - last);
+	for (b = buflist; b; b = b->next) {
+		if (!b->swapdirty) continue;
+		mswapput(b);
+		fflush(b->swap);
+		if (sync_on_write != SYNC_NONE) fdatasync(fileno(b->swap));
+		b->swapdirty = false;
+	}
+	last = now;
+	return -1;
+}
+
+int mswapreplay(Buffer *buf) {
+	/* Apply the crash journal of buf to it, and keep logging there.
+	 * Replaying stops at the first edit that wasn't written out
+	 * completely, and the rest is cut off. Returns the number of
+	 * edits, or -1 if there is no journal for this version of the
+	 * file. */
+	size_t y, x, n;
+	char op, *swp, *text = NULL;
+	FILE *fp;
+	long good;
+	int cnt = 0;
+
+	if (buf->swap || !buf->path || !(swp = mswappath(buf->path))) return -1;
+	if (!(fp = fopen(swp, "r"))) {
+		free(swp);
+		return -1;
+	}
+	if (!mswapmatch(buf, fp)) {
+		/* Made for some other version of the file */
+		fclose(fp);
+		free(swp);
+		return -1;
+	}
+	good = ftell(fp);
+
+	while (fscanf(fp, "%c %zu %zu %zu", &op, &y, &x, &n) == 4 && getc(fp) == '\n') {
+		Line *ln = y < buf->index->sum[0] ? mlnat(buf, y) : NULL;
+		if (!ln || x > ln->length || (op != 'i' && op != 'd')) break;
+		if (op == 'i') {
+			Edit e = { 0 };
+			Span sp;
+			if (!(text = (char*)realloc(text, n ? n : 1)) || fread(text, 1, n, fp) != n) break;
+			if (!(sp.data = maddtext(buf, text, n))) break;
+			sp.len = n;
+			e.y = y;
+			e.x = x;
+			e.spans = &sp;
+			e.nspans = 1;
+			mtextins(buf, &e);
+		} else {
+			mtextdel(buf, y, x, n);
+		}
+		good = ftell(fp);
+		cnt++;
+	}
+	free(text);
+	fclose(fp);
+
+	/* Edits from now on go after these, not after a torn one */
+	buf->swapstate = SWAP_OFF;
+	if (good < 0 || truncate(swp, good)) buf->swapstate = SWAP_FAILED;
+	else mswapopen(buf, "a");
+	free(swp);
+	buf->curline = buf->lines;
+	buf->cursor.c.x = buf->cursor.c.y = buf->starty = 0;
+	mchecklines(buf);
+	return cnt;
+}
+
+long mclock() {
+	/* Milliseconds from some fixed point */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool mtypeahead() {
+	/* Are there keys waiting? Curses reads them from stderr. */
+	struct pollfd pfd = { STDERR_FILENO, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
 }
 
 void mmove(Buffer *buf, int x, int y) {
 	int i, len;
 	int row;
+	size_t col, at;
 
 	row = getmaxy(bufwin);
 
-	/* left / right */
-	buf->cursor.c.x += x;
+	/* left / right, one character at a time */
+	for (; x > 0 && buf->cursor.c.x < (int)buf->curline->length; --x)
+		buf->cursor.c.x = mlnnext(buf->curline, buf->cursor.c.x);
+	for (; x < 0 && buf->cursor.c.x > 0; ++x)
+		buf->cursor.c.x = mlnprev(buf->curline, buf->cursor.c.x);
+
+	/* Stay in the same column when changing lines. Both ways, the
+	 * pieces before it are summed up in the tree. */
+	col = y ? mnumcols(buf, buf->curline, buf->cursor.c.x) : 0;
+
+	if (row > 0 && abs(y) > row) {
+		/* Don't walk the lines when jumping further than a screen */
+		long n = (long)mlnidx(buf->curline) + y;
+		long last = buf->index->sum[0] - 1;
+		Line *ln = mlnat(buf, n < 0 ? 0 : n > last ? last : n);
+		mgoto(buf, ln, mcolbyte(buf, ln, col, &at));
+		return;
+	}
 
-	/* up / down */
+	/* up / down, the lines stay where they are on the screen */
 	if (y < 0) {
 		for (i = 0; i < abs(y); ++i) {
-			if (buf->curline->prev) {
+			if (mprevln(buf, buf->curline)) {
 				buf->curline = buf->curline->prev;
 				buf->cursor.c.y--;
+				buf->starty += mnumvislines(buf, buf->curline) - 1;
 			} else break;
-			if (buf->cursor.c.y < buf->starty) {
-				/* Scroll the view up */
-				buf->starty -= mnumvislines(buf->curline);
-			}
 		}
 	} else {
 		for (i = 0; i < y; ++i) {
-			if (buf->curline->next) {
+			if (mnextln(buf, buf->curline)) {
+				buf->starty -= mnumvislines(buf, buf->curline) - 1;
 				buf->curline = buf->curline->next;
 				buf->cursor.c.y++;
 			} else break;
-			if (buf->cursor.c.y - buf->starty >= row) {
-				/* Scroll the view down */
-				buf->starty += mnumvislines(buf->curline);
-			}
 		}
 	}
 
-	/* Restrict cursor to line content */
-	len = wcslen(buf->curline->data);
-	buf->cursor.c.x = max(min(buf->cursor.c.x, len), 0);
+	if (y) buf->cursor.c.x = mcolbyte(buf, buf->curline, col, &at);
+
+	/* Restrict cursor to line content, at the start of a character */
+	len = buf->curline->length;
+	buf->cursor.c.x = mlnsnap(buf->curline, max(min(buf->cursor.c.x, len), 0));
 
 	/* Update selection end */
 	if (mode == MODE_SELECT) {
 		buf->cursor.v1 = (Coord){buf->cursor.c.x, buf->cursor.c.y};
 	}
+	mfollow(buf);
+}
+
+void mfollow(Buffer *buf) {
+	/* Scroll the view just far enough to have the cursor on the
+	 * screen, and all of its line if that fits. There are no empty
+	 * rows above the first line. Sideways, the view jumps by half
+	 * a screen so it doesn't have to be painted on every key. */
+	int row = getmaxy(buf == cmdbuf ? cmdwin : bufwin), cp, n, k, above;
+	int x = mcursorcol(buf), cols = mtextcols(buf);
+	Layout *l;
+	Line *ln;
+
+	if (!line_wrap && (x < 0 || x >= cols))
+		buf->startx = max(x + buf->startx - cols / 2, 0);
+	if (row <= 0) return;
+	l = mlayout(buf, buf->curline);
+	n = l->nrows ? l->nrows : 1;
+	k = mlayoutrow(l, buf->cursor.c.x);
+	cp = buf->cursor.c.y - buf->starty;
+	if (n <= row) cp = max(min(cp, row - n), 0);
+	else cp = max(min(cp, row - 1 - k), -k);
+	for (above = 0, ln = buf->curline; above < cp && (ln = mprevln(buf, ln));)
+		above += mnumvislines(buf, ln);
+	buf->starty = buf->cursor.c.y - min(cp, above);
 }
 
 void mjump(Buffer *buf, Marker mark) {
@@ -517,36 +2830,103 @@ void mjump(Buffer *buf, Marker mark) {
 		break;
 	case MARKER_MIDDLE:
 		{
-			Line *ln = buf->curline;
-			size_t len = wcslen(ln->data);
-			buf->cursor.c.x = (len/2);
+			size_t at, width = mlayout(buf, buf->curline)->width;
+			buf->cursor.c.x = mcolbyte(buf, buf->curline, width / 2, &at);
 		}
 		break;
 	case MARKER_END:
 		{
-			Line *ln = buf->curline;
-			size_t len = wcslen(ln->data);
+			size_t len = buf->curline->length;
 			buf->cursor.c.x = max(len, 0);
 		}
 		break;
 	}
 }
 
+void mgoto(Buffer *buf, Line *ln, int x) {
+	/* Put the cursor on any line and center the view on it */
+	if (!ln) return;
+	buf->curline = ln;
+	buf->cursor.c.y = mlnidx(ln);
+	buf->cursor.c.x = mlnsnap(ln, max(x, 0));
+	buf->starty = buf->cursor.c.y - getmaxy(bufwin) / 2;
+	mmove(buf, 0, 0);
+}
+
+void mgotopos(Buffer *buf, size_t y, size_t x) {
+	/* Put the cursor at x in line y, the view only moves if
+	 * that is off the screen */
+	Line *ln = mlnat(buf, y);
+	Row *rows;
+	int i, row;
+
+	if (!ln) return;
+	rows = mscreen(buf, &row);
+	for (i = 0; i < row && !(rows[i].ln == ln && x >= rows[i].from
+			&& (x < rows[i].to || x == ln->length)); ++i);
+	if (i == row) {
+		mgoto(buf, ln, x);
+	} else {
+		mrowgoto(buf, &rows[i], x, i);
+	}
+}
+
+void mrowgoto(Buffer *buf, const Row *r, size_t x, int at) {
+	/* Put the cursor at x on row r, which is row at of the screen */
+	buf->curline = r->ln;
+	buf->cursor.c.y = r->y;
+	buf->cursor.c.x = x;
+	buf->starty = r->y - (at - (int)r->k);
+	mmove(buf, 0, 0);
+}
+
+Row* mscreen(Buffer *buf, int *row) {
+	/* The rows of the window of buf as they are now,
+	 * valid until the next call */
+	static Row *rows;
+	static size_t cap;
+
+	*row = getmaxy(buf == cmdbuf ? cmdwin : bufwin);
+	if (*row <= 0 || !mreserve((void**)&rows, &cap, *row * sizeof(Row))) *row = 0;
+	else mlayoutrows(buf, rows, *row);
+	return rows;
+}
+
+void mpage(Buffer *buf, int dir) {
+	/* Scroll by a screen. The last row goes to the top, or the
+	 * first one to the bottom, and the cursor goes with it. */
+	int i, row, col = mcursorcol(buf);
+	Row *rows = mscreen(buf, &row);
+
+	if (!row) return;
+	if (dir > 0) for (i = row - 1; i > 0 && !rows[i].ln; --i);
+	else i = 0;
+	if (rows[i].ln) mrowgoto(buf, &rows[i], mrowbyte(&rows[i], col), dir > 0 ? 0 : row - 1);
+}
+
+
 void mselect(Buffer *buf, int x1, int y1, int x2, int y2) {
 	buf->cursor.v0 = (Coord){ x1, y1 };
 	buf->cursor.v1 = (Coord){ x2, y2 };
 }
 
-void mrepeat(const Action *ac, int n) {
-	int i;
-	n = min(n, max_cmd_repetition);
+void mrepeat(const Action *ac, size_t n) {
+	/* Run ac n times, or once if it takes the count itself */
+	static void (*const counted[])() = { gotoline, gotopercent };
+	size_t i;
+	for (i = 0; i < LENGTH(counted); ++i)
+		if (ac->fn == counted[i]) n = 1;
+	if (!n) n = 1;
+	if (n > max_cmd_repetition) n = max_cmd_repetition;
+	/* Everything a command does is undone at once */
+	if (curbuf) curbuf->undo.sealed = true;
 	for (i = 0; i < n; ++i)
 		ac->fn(ac);
 }
 
-int mfindchr(wchar_t *buf, int start, wchar_t c) {
+int mfindchr(char *buf, int start, char c) {
 	int i, len;
-	len = wcslen(buf);
+	len = strlen(buf);
 	for (i = start; i < len; ++i) {
 		if (buf[i] == c) return i;
 	}
@@ -581,37 +2961,41 @@ char* mexec(const char *cmd) {
 	return NULL;
 }
 
-void mruncmd(wchar_t *buf) {
-	wchar_t *cmd = NULL;
+void mruncmd(char *buf) {
+	char *cmd = NULL;
 	char *arg = NULL;
-	int cnt, exlen, cmdlen;
+	size_t cnt;
+	int exlen, cmdlen;
 	int i;
+	wchar_t key;
 
 	/* Parse decimal repetition count */
-	if (!(cnt = wcstol(buf, &cmd, 10))) cnt = 1;
+	cnt = strtoul(buf, &cmd, 10);
 
 	/* Find length of command */
-	exlen = wcslen(cmd);
+	exlen = strlen(cmd);
 	if (!exlen) return;
-	if ((cmdlen = mfindchr(cmd, 0, L' ')) < 0) {
+	if ((cmdlen = mfindchr(cmd, 0, ' ')) < 0) {
 		cmdlen = exlen;
 	}
 
 	/* Parse optional argument */
 	if (exlen > cmdlen) {
-		const wchar_t *warg = &cmd[cmdlen+1];
-		arg = (char*)malloc((exlen - cmdlen) * 4);
-		wcsrtombs(arg, &warg, (exlen - cmdlen) * 4, NULL);
+		arg = (char*)malloc(exlen - cmdlen);
+		strcpy(arg, &cmd[cmdlen+1]);
 	}
 
+	/* Single characters can also name a command by its key */
+	if (mutf8dec(cmd, cmdlen, &key) != cmdlen) key = 0;
+
 	/* Is it a builtin command? */
 	for (i = 0; i < (int)(sizeof(buffer_actions) / sizeof(Action)); ++i) {
 		if (buffer_actions[i].cmd) {
 			/* Check for valid command */
 			if (/* Either the single-char keyboard shortcut... */
-			    (cmdlen == 1 && buffer_actions[i].key == cmd[0]) ||
+			    (key && buffer_actions[i].key == key) ||
 			    /* ...or the full command */
-			    ((unsigned)cmdlen == wcslen(buffer_actions[i].cmd) && !wcsncmp(buffer_actions[i].cmd, cmd, cmdlen))) {
+			    ((unsigned)cmdlen == strlen(buffer_actions[i].cmd) && !strncmp(buffer_actions[i].cmd, cmd, cmdlen))) {
 				Action ac;
 				memcpy(&ac, &buffer_actions[i], sizeof(Action));
 				if (arg) {
@@ -624,7 +3008,9 @@ void mruncmd(wchar_t *buf) {
 				bool indent = auto_indent;
 				auto_indent = FALSE;
 				mode = MODE_INSERT;
+				repcnt = cnt;
 				mrepeat(&ac, cnt);
+				repcnt = 0;
 				mode = MODE_COMMAND;
 				auto_indent = indent;
 				/* TODO: Parse next command in chain */
@@ -635,6 +3021,17 @@ void mruncmd(wchar_t *buf) {
 	free(arg);
 }
 
+void mdirty(Buffer *buf, size_t from, size_t to) {
+	/* Lines from..to have to be painted again */
+	if (buf->dirty[0] >= buf->dirty[1]) {
+		buf->dirty[0] = from;
+		buf->dirty[1] = to;
+	} else {
+		if (from < buf->dirty[0]) buf->dirty[0] = from;
+		if (to > buf->dirty[1]) buf->dirty[1] = to;
+	}
+}
+
 void mpaintstat() {
 	Buffer *cur = buflist;
 	int col, nlines, bufsize;
@@ -654,6 +3051,9 @@ void mpaintstat() {
 	nlines = curbuf->numlines;
 	if (curbuf && curbuf->path) bufname = curbuf->path;
 	wprintw(statuswin, "%s, %i lines", bufname, nlines);
+	if (curbuf->load) wprintw(statuswin, ", loading %d%%", mloadprogress(curbuf));
+	else if (curbuf->partial) wprintw(statuswin, ", partly loaded");
+	if (curbuf->invalid) wprintw(statuswin, ", not UTF-8");
 
 	/* Mode, cursor pos */
 	cur = mode == MODE_COMMAND ? cmdbuf : buflist;
@@ -663,162 +3063,333 @@ void mpaintstat() {
 	if (use_colors) wattroff(statuswin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
 
 	if (use_colors) wattroff(statuswin, COLOR_PAIR(PAIR_STATUS_BAR));
-	wrefresh(statuswin);
+	wnoutrefresh(statuswin);
 }
 
-void mpaintln(Buffer *buf, Line *ln, WINDOW *win, int y, int n, bool numbers) {
-	int x, len;
-	int i, j;
-	int col;
+void mpaintln(Buffer *buf, WINDOW *win, const Row *rows, int y, int n, int num, bool numbers) {
+	/* Paint n rows of the same line from row y on. Characters are
+	 * put on the screen in runs that look the same. Only the
+	 * selected bytes look different, and those are the same on
+	 * every line of the selection. */
+	static wchar_t *run;
+	static size_t cap;
+	Coord s0 = buf->cursor.v0, s1 = buf->cursor.v1;
+	Line *ln = rows[y].ln;
+	int x, j, col, len = 0, rx = 0, last = y + n - 1, c0 = 0, c1 = 0, lc;
+	bool rowsel, sel = false, hi;
+	size_t pos = rows[y].from, left = rows[y].left, i;
+	Node *t;
+	Iter it;
 
 	col = getmaxx(win);
-	x = buf->offsetx;
-	len = wcslen(ln->data);
+	x = buf->offsetx - (rows[y].left - rows[y].col);
+	if (!mreserve((void**)&run, &cap, (col + 1) * sizeof(wchar_t))) return;
+	if (s1.x < s0.x) SWAP(s0.x, s1.x, int);
+	if (s1.y < s0.y) SWAP(s0.y, s1.y, int);
+	rowsel = (int)rows[y].y >= s0.y && (int)rows[y].y <= s1.y && s0.x >= 0;
+	if (rowsel) {
+		/* The selected columns of this line, up to the end of the
+		 * last character */
+		c0 = mnumcols(buf, ln, s0.x);
+		c1 = mnumcols(buf, ln, mlnnext(ln, mlnsnap(ln, s1.x)));
+	}
 
 	if (use_colors) wattron(win, COLOR_PAIR(PAIR_LINE_NUMBERS));
-	if (numbers && line_numbers) mvwprintw(win, y, 0, "%d", n);
+	if (numbers && line_numbers && !rows[y].k) mvwprintw(win, y, 0, "%d", num);
 	if (use_colors) wattroff(win, COLOR_PAIR(PAIR_LINE_NUMBERS));
 
-	for (i = 0; i < len; ++i) {
-		wchar_t c = ln->data[i];
-		int abs_y = y + buf->starty;
-		int abs_x = x - buf->offsetx;
+	mitinit(&it, rows[y].ln, pos);
+	for (t = it.t, i = it.off; t && pos < rows[last].to; t = mtnext(t), i = 0) {
+		const char *data = ((Piece*)t)->data;
+		while (i < t->len[0] && pos < rows[last].to) {
+			wchar_t c;
+
+			/* The rows of the line were worked out by mlayout,
+			 * the next one starts where this one ends */
+			if (pos >= rows[y].to) {
+				mputrun(win, y, rx, run, &len, sel);
+				x = buf->offsetx;
+				left = rows[++y].left;
+			}
 
-		/* When we hit the right edge of the screen,
-		 * we wrap to the beginning of the next line */
-		if (x >= col) {
-			x = buf->offsetx;
-			y++;
-		}
+			/* Most text is ASCII, which needs no decoding */
+			if ((unsigned char)data[i] < 0x80) {
+				c = data[i++];
+				pos++;
+			} else {
+				j = mutf8dec(data + i, t->len[0] - i, &c);
+				i += j;
+				pos += j;
+			}
 
-		/* Highlight the current selection */
-		Coord sel_start = buf->cursor.v0;
-		Coord sel_end = buf->cursor.v1;
-		if (sel_end.x < sel_start.x) SWAP(sel_start.x, sel_end.x, int);
-		if (sel_end.y < sel_start.y) SWAP(sel_start.y, sel_end.y, int);
-		if (abs_y >= sel_start.y &&
-				abs_y <= sel_end.y &&
-				abs_x >= sel_start.x &&
-				abs_x <= sel_end.x) {
-			wattron(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
-		}
+			/* Characters cut off at the left are left out */
+			if (x < buf->offsetx) {
+				x += mwidth(c);
+				continue;
+			}
+
+			/* Highlight the current selection, by column in the line */
+			lc = x - buf->offsetx + (int)left;
+			hi = rowsel && lc >= c0 && lc < c1;
+			if (hi != sel || !len) {
+				mputrun(win, y, rx, run, &len, sel);
+				sel = hi;
+				rx = x;
+			}
 
-		switch (c) {
+			switch (c) {
 			case L'\0':
 			case L'\n':
 			case L'\t':
-			{
-				cchar_t cc;
-				c = tab_beginning; setcchar(&cc, &c, 0, 0, 0);
-				mvwadd_wch(win, y, x++, &cc);
-				c = tab_character; setcchar(&cc, &c, 0, 0, 0);
-				for (j = 0; j < (int)tab_width-1; ++j) {
+				run[len++] = tab_beginning;
+				for (j = 1; j < (int)tab_width && x + j < col; ++j)
+					run[len++] = tab_character;
+				x += tab_width;
+				break;
+			default:
+				if (mcharwidth(c) == 1) {
+					run[len++] = c;
+				} else if (x + mwidth(c) <= col) {
+					/* Anything else goes on its own, like it used to */
+					wchar_t wc[2] = { c, 0 };
+					cchar_t cc;
+					mputrun(win, y, rx, run, &len, sel);
+					setcchar(&cc, wc, 0, 0, 0);
+					if (sel) wattron(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
 					mvwadd_wch(win, y, x, &cc);
-					x++;
+					wattroff(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
 				}
+				x += mwidth(c);
+				break;
 			}
-			break;
-			default:
-			{
-				cchar_t cc;
-				setcchar(&cc, &c, 0, 0, 0);
-				mvwadd_wch(win, y, x, &cc);
-				x++;
-			}
-			break;
 		}
-		wattroff(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
 	}
+	mputrun(win, y, rx, run, &len, sel);
+}
+
+void mputrun(WINDOW *win, int y, int x, const wchar_t *run, int *len, bool sel) {
+	/* Put a run from mpaintln on the screen. The cells are copied
+	 * over as they are, which is a lot less work than adding each
+	 * character. Runs never go past the edge. */
+	static chtype *ch;
+	static cchar_t *cc;
+	static size_t chcap, cccap;
+	wchar_t wc[2] = { 0 };
+	int i;
+
+	if (!*len) return;
+	for (i = 0; i < *len && run[i] < 0x80; ++i);
+	if (i == *len && mreserve((void**)&ch, &chcap, *len * sizeof(chtype))) {
+		/* ASCII fits into a chtype */
+		for (i = 0; i < *len; ++i)
+			ch[i] = run[i] | (sel ? COLOR_PAIR(PAIR_BUFFER_CONTENTS) : 0);
+		mvwaddchnstr(win, y, x, ch, *len);
+	} else if (mreserve((void**)&cc, &cccap, *len * sizeof(cchar_t))) {
+		for (i = 0; i < *len; ++i) {
+			wc[0] = run[i];
+			setcchar(&cc[i], wc, 0, sel ? PAIR_BUFFER_CONTENTS : 0, NULL);
+		}
+		mvwadd_wchnstr(win, y, x, cc, *len);
+	}
+	*len = 0;
 }
 
 void mpaintbuf(Buffer *buf, WINDOW *win, bool numbers) {
-	int i, l, cp;
-	int row;
-	Line *ln;
+	/* Paint the rows that changed or moved since the last time.
+	 * The rows of the last time are kept in the view of win. */
+	View *v = win == cmdwin ? &cmdview : &bufview;
+	Row *rows, *old = NULL;
+	int i, j, row, col, d = 0;
+	size_t y, cy;
+	bool full;
 
 	if (!buf || !bufwin) return;
-	row = getmaxy(win);
-	cp = buf->cursor.c.y - buf->starty;
+	getmaxyx(win, row, col);
 
-	/* Paint from the cursor to the bottom */
-	for (i = cp, l = 0, ln = buf->curline; i < row && ln; ++l, ln = ln->next) {
-		mpaintln(buf, ln, win, i, l, numbers);
-		i += mnumvislines(ln);
+	if (numbers && line_numbers) {
+		/* Make room for the biggest line number */
+		char num[32];
+		int len = snprintf(num, sizeof(num), "%lu", (unsigned long)buf->index->sum[0]);
+		buf->offsetx = max(4, len + 1);
+	}
+	mfollow(buf);
+
+	/* Everything moves with these */
+	full = v->buf != buf || v->offsetx != buf->offsetx || v->cols != col || v->startx != buf->startx
+		|| (numbers && relative_numbers) || (size_t)row != v->nrows
+		|| memcmp(&v->v0, &buf->cursor.v0, sizeof(Coord))
+		|| memcmp(&v->v1, &buf->cursor.v1, sizeof(Coord));
+	if (!full && !(old = (Row*)malloc(row * sizeof(Row)))) full = true;
+	if (old) memcpy(old, v->rows, row * sizeof(Row));
+	if (!mreserve((void**)&v->rows, &v->cap, row * sizeof(Row))) {
+		free(old);
+		v->buf = NULL;
+		return;
+	}
+	rows = v->rows;
+	mlayoutrows(buf, rows, row);
+	cy = mlnidx(buf->curline);
+
+	/* Scroll what is still on the screen to where it goes now,
+	 * going by the first row of a line that is on both. Lines
+	 * in the top row may have been cut off, so they don't count. */
+	for (i = 1; i < row && !full; ++i) {
+		y = rows[i].y;
+		if (!rows[i].ln || rows[i].k || (y >= buf->dirty[0] && y < buf->dirty[1])) continue;
+		for (j = 1; j < row && !(old[j].ln && old[j].y == y && !old[j].k); ++j);
+		if (j == row) continue;
+		d = j - i;
+		break;
+	}
+	if (d && abs(d) < row) {
+		scrollok(win, TRUE);
+		wscrl(win, d);
+		scrollok(win, FALSE);
+		if (d > 0) {
+			for (i = 0; i < row; ++i)
+				old[i] = i + d < row ? old[i + d] : (Row){ 0 };
+		} else {
+			for (i = row - 1; i >= 0; --i)
+				old[i] = i + d >= 0 ? old[i + d] : (Row){ 0 };
+		}
 	}
 
-	/* Paint from the cursor to the top */
-	for (i = cp, l = 0, ln = buf->curline; i >= 0 && ln; ++l, ln = ln->prev) {
-		mpaintln(buf, ln, win, i, l, numbers);
-		i -= ln->prev ? mnumvislines(ln->prev) : 1;
+	/* Rows that are still the same are left alone. The others are
+	 * painted again, as many of them as are next to each other
+	 * and show the same line. */
+	for (i = 0; i < row; i += j) {
+		Row *r = &rows[i];
+		for (j = 0; i + j < row; ++j) {
+			Row *p = &rows[i + j], *o = old ? &old[i + j] : NULL;
+			bool same = !full && (p->ln ? o->ln && o->y == p->y && o->k == p->k
+					&& o->from == p->from && o->to == p->to
+					&& (p->y < buf->dirty[0] || p->y >= buf->dirty[1]) : !o->ln);
+			if (j ? same || p->ln != r->ln || !p->ln : same) break;
+			wmove(win, i + j, 0);
+			wclrtoeol(win);
+		}
+		if (j && r->ln) {
+			y = r->y;
+			mpaintln(buf, win, rows, i, j,
+					relative_numbers ? (int)(y > cy ? y - cy : cy - y) : (int)y + 1, numbers);
+		}
+		if (!j) j = 1;
 	}
-	wrefresh(win);
+
+	free(old);
+	v->buf = buf;
+	v->offsetx = buf->offsetx;
+	v->startx = buf->startx;
+	v->cols = col;
+	v->v0 = buf->cursor.v0;
+	v->v1 = buf->cursor.v1;
+	v->nrows = row;
+	buf->dirty[0] = buf->dirty[1] = 0;
+	wnoutrefresh(win);
 }
 
 void mpaintcmd() {
+	static size_t shown = SIZE_MAX;
 	int bufsize;
 	int col;
 	char textbuf[32];
 
 	col = getmaxx(cmdwin);
-
-	if (use_colors) wattron(cmdwin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
+	if (repcnt != shown) mdirty(cmdbuf, 0, SIZE_MAX);
+	shown = repcnt;
 
 	/* Command */
 	mpaintbuf(cmdbuf, cmdwin, false);
 
 	/* Repetition count */
-	bufsize = snprintf(textbuf, sizeof(textbuf), "%d", repcnt);
+	if (use_colors) wattron(cmdwin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
+	bufsize = snprintf(textbuf, sizeof(textbuf), "%zu", repcnt);
 	mvwprintw(cmdwin, 0, col - bufsize, "%s", textbuf);
 
 	if (use_colors) wattroff(cmdwin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
-	wrefresh(cmdwin);
+	wnoutrefresh(cmdwin);
 }
 
 void resize() {
+	/* Fit the windows to the terminal and the command output. They
+	 * are made once, and after that only resized and moved when
+	 * the sizes they were made for change. */
+	static int rows, cols, cmdrows;
 	int row, col, nlines;
+
 	getmaxyx(stdscr, row, col);
-	nlines = mnumlines(cmdbuf);
-	if (statuswin) delwin(statuswin);
-	if (cmdwin) delwin(cmdwin);
-	if (bufwin) delwin(bufwin);
-	statuswin = newwin(1, col, 0, 0);
-	bufwin = newwin(row-nlines-1, col, 1, 0);
-	cmdwin = newwin(nlines, col, row-nlines, 0);
+	/* Long command output scrolls, at least one row of the
+	 * buffer is left */
+	nlines = min(cmdbuf->numlines, max(row - 2, 1));
+	if (statuswin && row == rows && col == cols && nlines == cmdrows) return;
+	rows = row;
+	cols = col;
+	cmdrows = nlines;
+
+	if (!statuswin) {
+		statuswin = newwin(1, col, 0, 0);
+		bufwin = newwin(row-nlines-1, col, 1, 0);
+		cmdwin = newwin(nlines, col, row-nlines, 0);
+		/* Lets scrolling use the terminal's insert and delete line */
+		idlok(bufwin, TRUE);
+	} else {
+		wresize(statuswin, 1, col);
+		wresize(bufwin, row-nlines-1, col);
+		/* The command window moves up before it grows and after
+		 * it shrinks, so that it always fits on the screen */
+		if (nlines > getmaxy(cmdwin)) mvwin(cmdwin, row-nlines, 0);
+		wresize(cmdwin, nlines, col);
+		mvwin(cmdwin, row-nlines, 0);
+	}
+	/* The command output ends at the bottom */
+	cmdbuf->starty = cmdbuf->cursor.c.y - nlines + mnumvislines(cmdbuf, cmdbuf->curline);
+	/* Whatever was painted is in the wrong place now */
+	bufview.buf = cmdview.buf = NULL;
 }
 
 void repaint() {
+	/* Everything is put together first, and sent in one go.
+	 * stdscr is cleared when the terminal changes size. get_wch
+	 * would refresh it over the windows, so it goes first. */
+	if (is_wintouched(stdscr)) {
+		wnoutrefresh(stdscr);
+		bufview.buf = cmdview.buf = NULL;
+	}
 	werase(statuswin);
-	werase(bufwin);
-	werase(cmdwin);
-	refresh();
 	mpaintstat();
 	mpaintcmd();
 	if (always_centered) coc();
 	mpaintbuf(curbuf, bufwin, true);
 	mupdatecursor();
+	doupdate();
 }
 
 void handlemouse() {
 	MEVENT ev;
 	if (getmouse(&ev) == OK) {
 		if (ev.bstate & BUTTON1_CLICKED) {
-			/* Jump to mouse location */
-			int x = ev.x, y = ev.y;
-			wmouse_trafo(bufwin, &y, &x, FALSE);
-			x -= curbuf->cursor.c.x + curbuf->offsetx + 1;
-			y -= curbuf->cursor.c.y + curbuf->starty;
-			mmove(curbuf, x, y);
+			/* Jump to mouse location. That is on the rows as they
+			 * were painted, unless there are edits to paint. */
+			int x = ev.x, y = ev.y, row = bufview.nrows;
+			Row *r = bufview.rows;
+			if (!wmouse_trafo(bufwin, &y, &x, FALSE)) return;
+			if (bufview.buf != curbuf || curbuf->dirty[0] < curbuf->dirty[1])
+				r = mscreen(curbuf, &row);
+			if (y >= row) return;
+			for (r += y; y > 0 && !r->ln; --r, --y);
+			if (!r->ln) return;
+			mrowgoto(curbuf, r, mrowbyte(r, max(x - curbuf->offsetx, 0)), y);
 		}
 	}
 }
 
 void quit() {
-	Buffer *buf = buflist;
-	do mfreebuf(buf); while((buf = buf->next));
+	while (buflist) mfreebuf(buflist);
 	delwin(cmdwin);
 	delwin(bufwin);
 	delwin(statuswin);
 	endwin();
+	if (bracketed_paste) fputs("\033[?2004l", stderr);
 	exit(0);
 }
 
@@ -832,27 +3403,79 @@ void setmode(const Action *ac) {
 }
 
 void save(const Action *ac) {
-	FILE *src, *bak;
-	Line *ln;
+	const char *path = ac->arg.v ? ac->arg.v : curbuf->path;
+	char *real, *tmp = NULL;
+	struct stat st;
+	int fd = -1, ok;
+	bool exists;
+
+	if (!path) return;
+	if (curbuf->load || (curbuf->partial && !ac->arg.v)) {
+		/* Only part of the file would be left */
+		mreadstr(cmdbuf, "Not saved, the buffer is not fully loaded\n");
+		resize();
+		return;
+	}
 
-	if (!ac->arg.v && !curbuf->path) return;
-	if (backup_on_write
-			&& (bak = fopen(backup_path, "w+"))
-			&& (src = fopen(curbuf->path, "r"))) {
-		char c;
-		while((c = getc(src)) != EOF)
-			fputc(c, bak);
+	/* Symbolic links are written through, not replaced */
+	if (!(real = realpath(path, NULL)) && !(real = strdup(path))) return;
+	if ((exists = !stat(real, &st)) && !S_ISREG(st.st_mode)) st.st_nlink = 0;
+
+	/* Write to a new file and rename it over the old one, so that a
+	 * crash leaves either of them whole. It gets the owner and mode
+	 * of the old file, or the usual mode for a new one. */
+	if ((!exists || st.st_nlink == 1) && (tmp = (char*)malloc(strlen(real) + 8))) {
+		mode_t mask = umask(0);
+		umask(mask);
+		sprintf(tmp, "%s.XXXXXX", real);
+		if ((fd = mkstemp(tmp)) >= 0 && (exists
+				? fchown(fd, st.st_uid, st.st_gid) || fchmod(fd, st.st_mode & 07777)
+				: fchmod(fd, 0666 & ~mask))) {
+			close(fd);
+			unlink(tmp);
+			fd = -1;
+		}
+		if (fd < 0) {
+			free(tmp);
+			tmp = NULL;
+		}
+	}
 
-		fclose(bak);
-		fclose(src);
+	/* The old file is kept before anything is written */
+	if (backup_on_write && exists) mbackup(real, backup_path, tmp != NULL);
+
+	/* Without a new file, the old one is written in place. That
+	 * keeps its hard links and owner, but a crash can leave it cut
+	 * short. A buffer mapped from it gets a copy of the pages first. */
+	if (!tmp && exists && curbuf->maplen && st.st_dev == curbuf->mapdev
+			&& st.st_ino == curbuf->mapino && !mdetach(curbuf)) {
+		free(real);
+		mreadstr(cmdbuf, "Not saved, out of memory\n");
+		resize();
+		return;
 	}
-	if (!(src = fopen(ac->arg.v ? ac->arg.v : curbuf->path, "w+"))) return;
-	for (ln = curbuf->lines; ln; ln = ln->next) {
-		fputws(ln->data, src);
-		if (ln->next) fputws(L"\n", src);
+	if (!tmp && (fd = open(real, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		free(real);
+		mreadstr(cmdbuf, "Not saved, can't open the file\n");
+		resize();
+		return;
 	}
 
-	fclose(src);
+	ok = mwritebuf(curbuf, fd) && (sync_on_write == SYNC_NONE || !fsync(fd));
+	if (close(fd) || !ok || (tmp && rename(tmp, real))) {
+		if (tmp) unlink(tmp);
+		mreadstr(cmdbuf, "Not saved, writing failed\n");
+		resize();
+	} else {
+		if (sync_on_write == SYNC_DIR) msyncdir(real);
+		if (curbuf->path && !strcmp(path, curbuf->path) && !stat(path, &curbuf->st)) {
+			/* Nothing left to recover, the next edit starts anew */
+			mswapclose(curbuf, false);
+			if (curbuf->swapstate != SWAP_FAILED) curbuf->swapstate = SWAP_OFF;
+		}
+	}
+	free(tmp);
+	free(real);
 }
 
 void readfile(const Action *ac) {
@@ -873,28 +3496,40 @@ void find(const Action *ac) {
 		char msgbuf[100];
 		regex_t reg;
 		Line *ln, *prev_ln = curbuf->curline;
-		int i, x, y = 0, wrapped = 0;
+		int i, y = 0, wrapped = 0;
 
 		if ((i = regcomp(&reg, ac->arg.v, 0))) {
 			regerror(i, &reg, msgbuf, sizeof(msgbuf));
 			return;
 		}
 
-		for (ln = curbuf->curline; ln; ln = ln->next, ++y) {
-			int lineoff = curbuf->cursor.c.x;
-			char buf[default_linebuf_size * 4];
-			const wchar_t *wdat = ln->data + lineoff * sizeof(wchar_t);
+		for (ln = curbuf->curline; ln; y += ln->n.len[0], ln = ln->next) {
+			int lineoff = min(curbuf->cursor.c.x, ln->length);
+			const char *dat = mlntext(ln);
 			regmatch_t match;
 
-			wcsrtombs(buf, &wdat, sizeof(buf), NULL);
-			i = regexec(&reg, buf, 1, &match, 0);
-			x = match.rm_so - curbuf->cursor.c.x + lineoff;
+			if (ln->lazy) {
+				/* Only load the line that matches */
+				size_t k;
+				if (!mfindlazy(ln, &reg, &match, &k)) continue;
+				/* Out of memory, give up */
+				if (!(ln = mlnload(curbuf, ln, k))) break;
+				y += k;
+				i = 0;
+			} else if (dat) {
+				/* Search the line in place, it isn't null-terminated */
+				match.rm_so = lineoff;
+				match.rm_eo = ln->length;
+				i = regexec(&reg, dat, 1, &match, REG_STARTEND);
+			} else break;
 			if (!i) {
 				/* Jump to location, select match */
-				int mx = x + curbuf->cursor.c.x;
-				int my = y + curbuf->cursor.c.y - curbuf->starty;
-				mmove(curbuf, x, y);
-				mselect(curbuf, mx, my, mx + match.rm_eo - match.rm_so - 1, my);
+				int mx = match.rm_so;
+				int my;
+				mmove(curbuf, 0, y);
+				my = curbuf->cursor.c.y;
+				curbuf->cursor.c.x = mx;
+				mselect(curbuf, mx, my, match.rm_eo - 1, my);
 				regfree(&reg);
 				return;
 			}
@@ -911,6 +3546,19 @@ void find(const Action *ac) {
 	}
 }
 
+int mfindlazy(Line *blk, regex_t *reg, regmatch_t *match, size_t *k) {
+	/* Search the lines of an unloaded block, store the number of
+	 * the first matching one in k */
+	const char *s = blk->lazy, *end = s + blk->n.len[1], *e;
+	for (*k = 0; s < end; ++*k, s = e + 1) {
+		e = memchr(s, '\n', end - s);
+		match->rm_so = 0;
+		match->rm_eo = e - s;
+		if (!regexec(reg, s, 1, match, REG_STARTEND)) return 1;
+	}
+	return 0;
+}
+
 void listbuffers() {
 	Buffer *buf = buflist;
 	int i = 0;
@@ -926,6 +3574,31 @@ void listbuffers() {
 	} while((buf = buf->next));
 }
 
+void memstats() {
+	/* Slab usage of every buffer: objects in use out of allocated,
+	 * and how many of the handed out ones were freed again */
+	Buffer *buf = buflist;
+	int i = 0;
+	do {
+		Pool *pools[] = { &buf->linepool, &buf->piecepool };
+		const char *names[] = { "lines", "pieces" };
+		int j;
+		for (j = 0; j < 2; ++j) {
+			Pool *p = pools[j];
+			size_t used = p->cap - (p->slabs ? p->slabs->cap - p->slabs->used : 0);
+			char str[128];
+			snprintf(
+				str,
+				sizeof(str),
+				"%d %s: %zu/%zu in %zu slabs, %zu free (%d%%)\n",
+				i, names[j], used - p->nfree, p->cap, p->nslabs,
+				p->nfree, used ? (int)(100 * p->nfree / used) : 0);
+			mreadstr(cmdbuf, str);
+		}
+		i++;
+	} while((buf = buf->next));
+}
+
 void motion(const Action *ac) {
 	mmove(curbuf, ac->arg.x, ac->arg.y);
 }
@@ -937,17 +3610,55 @@ void jump(const Action *ac) {
 void coc() {
 	/* Center on cursor */
 	int row = getmaxy(bufwin);
-	curbuf->starty = -(row / 2 - curbuf->cursor.c.y);
+	size_t k = mlayoutrow(mlayout(curbuf, curbuf->curline), curbuf->cursor.c.x);
+	curbuf->starty = curbuf->cursor.c.y - (row / 2 - (int)k);
+}
+
+void gotoline(const Action *ac) {
+	/* Go to line n (counting from 1) or to the last line */
+	size_t total = curbuf->index->sum[0];
+	char *end = NULL;
+	size_t n = ac->arg.v ? strtoul(ac->arg.v, &end, 10) : repcnt;
+	if (end && *end == '%') {
+		gotopercent(ac);
+		return;
+	}
+	if (!n || n > total) n = total;
+	mgoto(curbuf, mlnat(curbuf, n - 1), 0);
+}
+
+void gotooffset(const Action *ac) {
+	/* Go to the character at an offset from the start of the buffer */
+	size_t off = 0, total = curbuf->index->sum[1];
+	Line *ln;
+	if (ac->arg.v) off = strtoul(ac->arg.v, NULL, 10);
+	if (off >= total) off = total - 1;
+	if ((ln = (Line*)mtfind(curbuf->index, 1, off, &off)) && ln->lazy) {
+		/* Count the lines before off inside the unloaded block */
+		const char *s = ln->lazy, *e;
+		size_t k = 0;
+		for (; (e = memchr(s, '\n', ln->lazy + off - s)); s = e + 1) k++;
+		off -= s - ln->lazy;
+		ln = mlnload(curbuf, ln, k);
+	}
+	if (ln) mgoto(curbuf, ln, off);
+}
+
+void gotopercent(const Action *ac) {
+	/* Go to the line n% into the buffer */
+	size_t total = curbuf->index->sum[0];
+	size_t n = ac->arg.v ? strtoul(ac->arg.v, NULL, 10) : repcnt;
+	if (!n) return;
+	if (n > 100) n = 100;
+	mgoto(curbuf, mlnat(curbuf, ((total - 1) * n + 99) / 100), 0);
 }
 
 void pgup() {
-	int row = getmaxy(bufwin)-1;
-	mmove(curbuf, 0, -row);
+	mpage(curbuf, -1);
 }
 
 void pgdown() {
-	int row = getmaxy(bufwin)-1;
-	mmove(curbuf, 0, +row);
+	mpage(curbuf, +1);
 }
 
 void cls() {
@@ -955,6 +3666,14 @@ void cls() {
 	resize();
 }
 
+void wrap() {
+	/* Switch between wrapping lines and scrolling sideways */
+	line_wrap = !line_wrap;
+	curbuf->startx = cmdbuf->startx = 0;
+	mfollow(curbuf);
+	mfollow(cmdbuf);
+}
+
 void bufsel(const Action *ac) {
 	/* TODO: Forward/backward multiple buffers */
 	if (ac->arg.i < 0) {
@@ -970,18 +3689,34 @@ void bufdel(const Action *ac) {
 	}
 }
 
+void cancel() {
+	/* Stop loading the current buffer, but keep what is there */
+	if (curbuf->load) {
+		mloadstop(curbuf->load);
+		mloadstep(curbuf);
+	}
+}
+
 void insert(const Action *ac) {
 	minsert(curbuf, ac->arg.i);
 }
 
 void freeln() {
-	Line *ln = curbuf->curline, *next = ln->next ? ln->next : ln->prev;
+	Line *ln = curbuf->curline, *next = mnextln(curbuf, ln);
+	if (!next) next = mprevln(curbuf, ln);
 	if (next) {
+		mdirty(curbuf, mlnidx(next == ln->next ? ln : next), SIZE_MAX);
+		/* Journaled as its text going, then a newline */
+		mrecord(curbuf, true, ln, 0, NULL, ln->length);
+		if (next == ln->next) mrecord(curbuf, true, ln, 0, "\n", 1);
+		else mrecord(curbuf, true, next, next->length, "\n", 1);
 		curbuf->curline = next;
-		mfreeln(ln);
+		if (next == ln->prev) curbuf->cursor.c.y--;
+		mfreeln(curbuf, ln);
 		if (ln == curbuf->lines) {
 			curbuf->lines = next;
 		}
+		mchecklines(curbuf);
 	}
 }
 
@@ -995,3 +3730,28 @@ void newln() {
 	minsert(curbuf, L'\n');
 	mode = MODE_INSERT;
 }
+
+void undo() {
+	mundo(curbuf, false);
+}
+
+void redo() {
+	mundo(curbuf, true);
+}
+
+void recover() {
+	/* Bring back the changes from a crash journal */
+	char msg[64];
+	int n;
+	if (curbuf->load) {
+		mreadstr(cmdbuf, "Not recovered, the buffer is not fully loaded\n");
+	} else if (curbuf->swap || curbuf->swapstate == SWAP_HELD) {
+		mreadstr(cmdbuf, "Not recovered, the buffer was changed since\n");
+	} else if ((n = mswapreplay(curbuf)) < 0) {
+		mreadstr(cmdbuf, "Not recovered, there is no journal for this file as it is\n");
+	} else {
+		sprintf(msg, "Recovered %d changes\n", n);
+		mreadstr(cmdbuf, msg);
+	}
+	resize();
+}
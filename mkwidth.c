@@ -0,0 +1,70 @@
+/* Writes width.h, the number of columns of every character as
+ * wcwidth() in a UTF-8 locale sees it. Characters it doesn't know
+ * or can't print take up no columns.
+ *
+ * Characters come in blocks of 256. The index says which block a
+ * character is in, and blocks that are the same are only kept once.
+ * Every entry takes two bits. */
+#define _XOPEN_SOURCE 700
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#define NCHARS 0x110000
+#define BLOCK 256
+
+static unsigned char blocks[NCHARS / BLOCK][BLOCK / 4];
+static unsigned char idx[NCHARS / BLOCK];
+
+int main(int argc, char **argv) {
+	const char *locale = argc > 1 ? argv[1] : "C.UTF-8";
+	unsigned char cur[BLOCK / 4];
+	int nblocks = 0, b, i, j;
+	long c;
+
+	if (!setlocale(LC_CTYPE, locale)) {
+		fprintf(stderr, "mkwidth: no locale %s\n", locale);
+		return 1;
+	}
+
+	for (b = 0; b < NCHARS / BLOCK; ++b) {
+		memset(cur, 0, sizeof(cur));
+		for (i = 0; i < BLOCK; ++i) {
+			int w = wcwidth((wchar_t)(b * BLOCK + i));
+			cur[i / 4] |= (w > 0 ? w : 0) << (i % 4 * 2);
+		}
+		for (j = 0; j < nblocks && memcmp(blocks[j], cur, sizeof(cur)); ++j);
+		if (j == nblocks) memcpy(blocks[nblocks++], cur, sizeof(cur));
+		if (j > 255) {
+			fprintf(stderr, "mkwidth: too many blocks\n");
+			return 1;
+		}
+		idx[b] = j;
+	}
+
+	/* ASCII doesn't need the table, but check it agrees */
+	for (c = 0; c < 0x80; ++c) {
+		int w = wcwidth((wchar_t)c);
+		if ((w > 0 ? w : 0) != (c >= 0x20 && c < 0x7f)) {
+			fprintf(stderr, "mkwidth: unexpected width for %ld\n", c);
+			return 1;
+		}
+	}
+
+	printf("/* Generated by mkwidth.c from wcwidth() in %s, see mcharwidth() */\n", locale);
+	printf("static const unsigned char width_index[%d] = {", NCHARS / BLOCK);
+	for (b = 0; b < NCHARS / BLOCK; ++b)
+		printf("%s%d,", b % 16 ? " " : "\n\t", idx[b]);
+	printf("\n};\n\n");
+	printf("static const unsigned char width_blocks[%d][%d] = {\n", nblocks, BLOCK / 4);
+	for (j = 0; j < nblocks; ++j) {
+		printf("\t{");
+		for (i = 0; i < BLOCK / 4; ++i)
+			printf("%s0x%02x,", i % 16 ? " " : "\n\t\t", blocks[j][i]);
+		printf("\n\t},\n");
+	}
+	printf("};\n");
+	return 0;
+}